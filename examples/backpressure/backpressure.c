@@ -0,0 +1,75 @@
+// Bounds the number of pending tasks with TP_BACKPRESSURE_RUN_INLINE: the producer (the main thread, not a worker) processes the tasks beyond the bound itself,
+// while another thread adds successors (threadpool_add_task_after) to the tasks being processed, inline or not.
+// The successors released by the producer are queued for the workers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <threads.h>
+#include "wqm.h"
+
+static const size_t NB_TASKS = 200;
+static const struct timespec WORK = {.tv_sec = 0,.tv_nsec = 2000000 };  // 2 ms: successors are added while the task is processed.
+static _Atomic int Done = 0;
+static _Atomic size_t Nb_started = 0, Nb_processed = 0, Nb_successors = 0;
+
+static tp_result_t
+work (void *job)
+{
+  (void) job;
+  Nb_started++;
+  thrd_sleep (&WORK, 0);
+  Nb_processed++;
+  return TP_JOB_SUCCESS;
+}
+
+static tp_result_t
+successor (void *job)
+{
+  (void) job;
+  Nb_successors++;
+  return TP_JOB_SUCCESS;
+}
+
+// Adds a successor to every task submitted by the main thread once it has started (pending tasks may be given a successor too),
+// while it is processed, inline or not, or after it has completed. Task ids are 1, 2, ... for the tasks and their successors mixed.
+static int
+add_successors (void *arg)
+{
+  struct threadpool *tp = arg;
+  char *is_successor = calloc (2 * NB_TASKS + 1, 1);      // Ids of the successors.
+  assert (is_successor);
+  size_t nb = 0;
+  for (tp_task_t id = 1, own; nb < NB_TASKS && !Done;)
+    if (is_successor[id])
+      id++;                     // Successors are not given successors.
+    else if (nb < Nb_started)   // The task 'id' has been submitted.
+    {
+      assert ((own = threadpool_add_task_after (tp, successor, 0, 0, 1, &id)));
+      is_successor[own] = 1;
+      nb++;
+      id++;
+    }
+    else
+      thrd_yield ();
+  free (is_successor);
+  return (int) nb;
+}
+
+int
+main (void)
+{
+  struct threadpool *tp = threadpool_create_and_start (1, 0, TP_RUN_ALL_TASKS);
+  threadpool_set_task_futures (tp, 1);
+  threadpool_set_max_pending (tp, 1, TP_BACKPRESSURE_RUN_INLINE);
+  thrd_t adder;
+  assert (thrd_create (&adder, add_successors, tp) == thrd_success);
+  for (size_t i = 0; i < NB_TASKS; i++)
+    threadpool_add_task (tp, work, 0, 0);       // Beyond 1 pending task, processed inline by the main thread.
+  threadpool_wait_all (tp);
+  Done = 1;
+  int nb_added;
+  thrd_join (adder, &nb_added);
+  threadpool_wait_and_destroy (tp);
+  fprintf (stdout, "%zu tasks processed (%zu submitted), %zu successors processed (%d added).\n", (size_t) Nb_processed, NB_TASKS, (size_t) Nb_successors, nb_added);
+  return Nb_processed == NB_TASKS && Nb_successors == (size_t) nb_added ? EXIT_SUCCESS : EXIT_FAILURE;
+}
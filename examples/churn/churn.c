@@ -0,0 +1,52 @@
+// Measures the cost of creating and reaping thousands of workers: every round, a burst of blocking tasks forces the thread pool to start
+// as many workers as tasks, which are ended by the idle timeout before the next round.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <threads.h>
+#include "wqm.h"
+
+static const size_t NB_WORKERS = 4000;
+static const size_t NB_ROUNDS = 5;
+static const struct timespec BLOCK = {.tv_sec = 0,.tv_nsec = 20000000 };        // 20 ms: every task keeps its worker busy during the burst.
+static const struct timespec REAP = {.tv_sec = 0,.tv_nsec = 200000000 };        // 200 ms: idle workers time out (after 0.1 s).
+
+static double
+elapsed_ms (struct timespec from, struct timespec to)
+{
+  return 1.e3 * difftime (to.tv_sec, from.tv_sec) + 1.e-6 * (double) (to.tv_nsec - from.tv_nsec);
+}
+
+static int
+work (void *arg)
+{
+  (void) arg;
+  thrd_sleep (&BLOCK, 0);
+  return EXIT_SUCCESS;
+}
+
+int
+main (int argc, char *argv[])
+{
+  size_t nb_workers = argc > 1 ? strtoul (argv[1], 0, 10) : NB_WORKERS;
+  struct threadpool *tp = threadpool_create_and_start (nb_workers, 0, TP_RUN_ALL_TASKS);
+  fprintf (stdout, "(%zu workers, %zu rounds)\n", nb_workers, NB_ROUNDS);
+  double submit = 0, round = 0;
+  for (size_t r = 0; r < NB_ROUNDS; r++)
+  {
+    struct timespec t0, t1, t2;
+    timespec_get (&t0, TIME_UTC);
+    for (size_t i = 0; i < nb_workers; i++)
+      threadpool_add_task (tp, work, 0, 0);     // Starts a worker (all others are busy).
+    timespec_get (&t1, TIME_UTC);
+    threadpool_wait_all (tp);
+    timespec_get (&t2, TIME_UTC);
+    submit += elapsed_ms (t0, t1);
+    round += elapsed_ms (t0, t2);
+    thrd_sleep (&REAP, 0);      // Workers are reaped.
+  }
+  threadpool_wait_and_destroy (tp);
+  fprintf (stdout, "Submission (creation of workers):  %8.1f ms per round, %6.2f µs per worker\n", submit / (double) NB_ROUNDS,
+           1.e3 * submit / (double) NB_ROUNDS / (double) nb_workers);
+  fprintf (stdout, "Burst (until all tasks are done):   %8.1f ms per round\n", round / (double) NB_ROUNDS);
+}
@@ -117,6 +117,8 @@ struct tp1_resource
   size_t nb_lines;
   wchar_t (*lines)[100];        // Pointer to type const wchar_t[100]
   wchar_t **colllines;
+  struct tp2_global tp2_global;
+  struct threadpool *tp2;       // Reused for every word (workers are kept warm between words).
 };
 
 static void *
@@ -157,6 +159,8 @@ tp1_res_alloc (void *global_data)
   }
   fclose (f);
 
+  res.tp2 = threadpool_create_and_start (TP_WORKER_NB_CPU, &res.tp2_global, TP_RUN_ALL_TASKS);
+  threadpool_set_worker_local_data_manager (res.tp2, tp2_make_local, tp2_delete_local);
   return &res;
 }
 
@@ -164,6 +168,7 @@ static void
 tp1_res_dealloc (void *p)
 {
   struct tp1_resource *res = p;
+  threadpool_wait_and_destroy (res->tp2);
   free (res->lines);
 #ifdef COLLATE
   for (size_t i = 0; i < res->nb_lines; i++)
@@ -200,15 +205,20 @@ tp1_job_free (void *arg, tp_result_t res)
 #define COLLATE
 
 static const wchar_t *
-get_match (wchar_t *wa, size_t nb_lines, const wchar_t (*const lines)[100], wchar_t *const *const colllines)
+get_match (wchar_t *wa, struct tp1_resource *res)
 {
+  size_t nb_lines = res->nb_lines;
+  const wchar_t (*const lines)[100] = res->lines;
+  wchar_t *const *const colllines = res->colllines;
+  struct threadpool *tp2 = res->tp2;
+  struct tp2_global *tp2_global = &res->tp2_global;     // Global data of tp2.
+  *tp2_global = (struct tp2_global) {.match = 0,.dmatch = ULONG_MAX };
   size_t start = ((size_t) rand ()) % nb_lines; // To avoid false-sharing.
-  struct tp2_global tp2_global = {.match = 0,.dmatch = ULONG_MAX };
-  for (size_t i = 0; !tp2_global.match && i < nb_lines; i++)
+  for (size_t i = 0; !tp2_global->match && i < nb_lines; i++)
     if (!wcscmp (wa, lines[(i + start) % nb_lines]))
-      tp2_global.match = lines[(i + start) % nb_lines]; // Perfect match found.
+      tp2_global->match = lines[(i + start) % nb_lines];        // Perfect match found.
 
-  if (!tp2_global.match)        // Search for an approximate match.
+  if (!tp2_global->match)       // Search for an approximate match.
   {
     wchar_t *fuzzyword = wa;
 
@@ -219,29 +229,33 @@ get_match (wchar_t *wa, size_t nb_lines, const wchar_t (*const lines)[100], wcha
     fuzzyword = collwa;
 #endif
 
-    struct threadpool *tp2 = threadpool_create_and_start (TP_WORKER_NB_CPU, &tp2_global, TP_RUN_ALL_TASKS);
-    threadpool_set_worker_local_data_manager (tp2, tp2_make_local, tp2_delete_local);
-    for (size_t i = 0; tp2_global.dmatch && i < nb_lines; i++)
+    void *jobs[1024];           // Tasks are submitted by batches.
+    for (size_t i = 0; tp2_global->dmatch && i < nb_lines;)
     {
-      const wchar_t *realword = lines[(i + start) % nb_lines];  // To avoid false-sharing.
-      const wchar_t *word = realword;
+      size_t nb_jobs = 0;
+      for (; nb_jobs < sizeof (jobs) / sizeof (*jobs) && i < nb_lines; i++, nb_jobs++)
+      {
+        const wchar_t *realword = lines[(i + start) % nb_lines];        // To avoid false-sharing.
+        const wchar_t *word = realword;
 #ifdef COLLATE
-      word = colllines[(i + start) % nb_lines]; // To avoid false-sharing.
+        word = colllines[(i + start) % nb_lines];       // To avoid false-sharing.
 #endif
-      struct tp2_job *job = malloc (sizeof (*job));
-      *job = (struct tp2_job)
-      {
-        {word, realword, fuzzyword},
-        {0, 0},
-      };
-      threadpool_add_task (tp2, tp2_worker, job, tp2_job_free);
-    }                           // for (size_t i = 0; dmatch && i < nb_lines; i++)
-    threadpool_wait_and_destroy (tp2);
+        struct tp2_job *job = malloc (sizeof (*job));
+        *job = (struct tp2_job)
+        {
+          {word, realword, fuzzyword},
+          {0, 0},
+        };
+        jobs[nb_jobs] = job;
+      }
+      threadpool_add_tasks (tp2, nb_jobs, tp2_worker, jobs, tp2_job_free);
+    }                           // for (size_t i = 0; dmatch && i < nb_lines;)
+    threadpool_wait_all (tp2); // tp2 is kept alive for the next word.
 #ifdef COLLATE
     free (collwa);
 #endif
   }                             //  if (!match)
-  return tp2_global.match;
+  return tp2_global->match;
 }
 
 static int
@@ -249,7 +263,7 @@ tp1_worker (void *arg)
 {
   struct tp1_job *ta = arg;
   struct tp1_resource *tp1_resource = threadpool_global_resource ();
-  ta->result.match_ref = get_match (ta->input.wa, tp1_resource->nb_lines, tp1_resource->lines, tp1_resource->colllines);
+  ta->result.match_ref = get_match (ta->input.wa, tp1_resource);
   return EXIT_SUCCESS;
 }
 
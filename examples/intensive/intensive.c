@@ -1,5 +1,5 @@
-#include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <locale.h>
 #include <sys/resource.h>
 #include <stdint.h>
@@ -8,7 +8,7 @@
 static int
 worker (void *)
 {
-  sleep (1);
+  threadpool_task_sleep (1.);   // Without fibers, the worker thread sleeps.
   return EXIT_SUCCESS;
 }
 
@@ -18,17 +18,22 @@ monitor_start_and_stop (struct threadpool_monitor d)
   return (d.workers.nb_alive == 0);
 }
 
+static size_t max_stack_bytes = 0;
+
 static void
 monitor_handler (struct threadpool_monitor d, void *f)
 {
   int (*filter) (struct threadpool_monitor) = f;
+  if (d.memory.nb_stack_reserved_bytes > max_stack_bytes)
+    max_stack_bytes = d.memory.nb_stack_reserved_bytes;
   if (filter (d))
-    fprintf (stdout, "t=%1$f s: %2$'zu workers have been active (over %3$'zu requested). %4$'zu tasks have been processed (over %5$'zu submitted)).\n",
-             d.time, d.workers.nb_max, d.workers.nb_requested, d.tasks.nb_succeeded, d.tasks.nb_submitted);
+    fprintf (stdout, "t=%1$f s: %2$'zu workers have been active (over %3$'zu requested). %4$'zu tasks have been processed (over %5$'zu submitted)). "
+             "Up to %6$'zu MB of stack reserved.\n",
+             d.time, d.workers.nb_max, d.workers.nb_requested, d.tasks.nb_succeeded, d.tasks.nb_submitted, max_stack_bytes >> 20);
 }
 
 int
-main (void)
+main (int argc, char *argv[])
 {
   setlocale (LC_ALL, "");
 #define getrlimit(resource) do { struct rlimit resource; getrlimit (RLIMIT_##resource, &resource); fprintf (stdout, "getrlimit (" #resource ") = %'jd\n", (intmax_t) resource.rlim_cur); } while (0)
@@ -37,14 +42,22 @@ main (void)
   getrlimit (STACK);
   getrlimit (MEMLOCK);
   // Limit of 9212 threads on my system with default configuration.
-  const size_t MAX_NB_THREADS = 9500;
-  size_t nb_requested_workers = MAX_NB_THREADS; // Only MAX_NB_THREADS will be allocated.
-  size_t nb_tasks = 4 * nb_requested_workers;
+  // The stack size of the workers, in kB, can be passed as first argument (e.g. 64): many more threads can then be started.
+  // With "fibers" as first argument instead, the tasks sleep on fibers, multiplexed over as many workers as CPUs.
+  int fibers = argc > 1 && !strcmp (argv[1], "fibers");
+  size_t stack_size = argc > 1 && !fibers ? strtoul (argv[1], 0, 10) << 10 : 0;
+  const size_t MAX_NB_THREADS = stack_size ? 30000 : 9500;
+  size_t nb_requested_workers = fibers ? TP_WORKER_NB_CPU : MAX_NB_THREADS;     // Only MAX_NB_THREADS will be allocated.
+  size_t nb_tasks = 4 * MAX_NB_THREADS;
 
   struct threadpool *tp = threadpool_create_and_start (nb_requested_workers, 0, TP_RUN_ALL_TASKS);
   (void) monitor_handler;
   (void) monitor_start_and_stop;
   threadpool_set_monitor (tp, monitor_handler, monitor_start_and_stop, 0);
+  if (stack_size)
+    threadpool_set_worker_stack (tp, stack_size, 0);    // With the default guard page.
+  if (fibers)
+    threadpool_set_fibers (tp, 32 << 10);
   for (size_t i = 0; i < nb_tasks; i++)
     threadpool_add_task (tp, worker, 0, 0);
   threadpool_wait_and_destroy (tp);
@@ -0,0 +1,84 @@
+// Measures the latency between the submission of a task and the start of its processing by a worker,
+// when tasks arrive in bursts, with idle workers waiting for a signal (default) or polling for new tasks (see threadpool_set_idle_spin),
+// and when bursts are sparser than the idle timeout, with workers started on demand (default) or kept warm (see threadpool_set_min_workers).
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <threads.h>
+#include "wqm.h"
+
+static const size_t NB_BURSTS = 2000;
+static const struct timespec PAUSE = {.tv_sec = 0,.tv_nsec = 200000 };  // 200 µs between bursts: workers get idle.
+static const size_t NB_SPARSE_BURSTS = 20;
+static const struct timespec SPARSE_PAUSE = {.tv_sec = 0,.tv_nsec = 150000000 };       // 150 ms between bursts: idle workers time out (after 0.1 s).
+
+struct job
+{
+  struct timespec submitted;
+  double *latency;
+};
+
+static double
+elapsed_us (struct timespec from, struct timespec to)
+{
+  return 1.e6 * difftime (to.tv_sec, from.tv_sec) + 1.e-3 * (double) (to.tv_nsec - from.tv_nsec);
+}
+
+static int
+work (void *arg)
+{
+  struct job *job = arg;
+  struct timespec started;
+  timespec_get (&started, TIME_UTC);
+  *job->latency = elapsed_us (job->submitted, started);
+  return EXIT_SUCCESS;
+}
+
+static int
+cmp (const void *a, const void *b)
+{
+  double da = *(const double *) a, db = *(const double *) b;
+  return (da > db) - (da < db);
+}
+
+static void
+measure (double spin, int warm, size_t nb_bursts, const struct timespec *pause)
+{
+  struct threadpool *tp = threadpool_create_and_start (TP_WORKER_NB_CPU, 0, TP_RUN_ALL_TASKS);
+  threadpool_set_idle_spin (tp, spin);
+  size_t burst = threadpool_nb_workers (tp);    // One task per worker.
+  if (warm)
+    threadpool_set_min_workers (tp, burst);
+  size_t nb_tasks = nb_bursts * burst;
+  double *latency = calloc (nb_tasks, sizeof (*latency));
+  if (!latency)
+    return;
+  for (size_t b = 0; b < nb_bursts; b++)
+  {
+    for (size_t i = 0; i < burst; i++)
+    {
+      struct job *job = malloc (sizeof (*job));
+      if (!job)
+        break;
+      job->latency = &latency[b * burst + i];
+      timespec_get (&job->submitted, TIME_UTC);
+      threadpool_add_task (tp, work, job, threadpool_job_free_handler);
+    }
+    thrd_sleep (pause, 0);
+  }
+  threadpool_wait_and_destroy (tp);
+  qsort (latency, nb_tasks, sizeof (*latency), cmp);
+  fprintf (stdout, "%s %6.0f µs: submit-to-start latency (µs) over %zu tasks: p50 %8.1f   p90 %8.1f   p99 %8.1f   max %8.1f\n",
+           warm ? "warm" : "spin", 1.e6 * spin, nb_tasks, latency[nb_tasks / 2], latency[nb_tasks * 9 / 10], latency[nb_tasks * 99 / 100], latency[nb_tasks - 1]);
+  free (latency);
+}
+
+int
+main (void)
+{
+  measure (0, 0, NB_BURSTS, &PAUSE);    // Park at once.
+  measure (50.e-6, 0, NB_BURSTS, &PAUSE);       // Spin shorter than the pause between bursts.
+  measure (1.e-3, 0, NB_BURSTS, &PAUSE);        // Spin longer than the pause between bursts.
+  measure (0, 0, NB_SPARSE_BURSTS, &SPARSE_PAUSE);      // Workers are started again for every burst.
+  measure (0, 1, NB_SPARSE_BURSTS, &SPARSE_PAUSE);      // Workers are kept warm.
+}
@@ -0,0 +1,62 @@
+// An inner thread pool borrows the workers of an outer thread pool (threadpool_borrow_workers): a task of the outer thread pool submits a batch of tasks
+// to the inner one and waits for them. The inner tasks are processed by the threads of the outer thread pool only, as the inner thread pool starts no thread of its own.
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <threads.h>
+#include "wqm.h"
+
+static const size_t NB_OUTER_WORKERS = 2;
+static const size_t NB_INNER_WORKERS = 4;
+static const size_t NB_INNER_TASKS = 200;
+static const struct timespec WORK = {.tv_sec = 0,.tv_nsec = 100000 };   // 100 µs.
+
+static struct threadpool *Inner;
+static mtx_t Mutex;
+static thrd_t Threads[16];      // Distinct threads which processed inner tasks.
+static size_t Nb_threads = 0;
+
+static tp_result_t
+inner_task (void *job)
+{
+  (void) job;
+  thrd_sleep (&WORK, 0);
+  thrd_t self = thrd_current ();
+  mtx_lock (&Mutex);
+  size_t i = 0;
+  while (i < Nb_threads && !thrd_equal (Threads[i], self))
+    i++;
+  if (i == Nb_threads && Nb_threads < sizeof (Threads) / sizeof (*Threads))
+    Threads[Nb_threads++] = self;
+  mtx_unlock (&Mutex);
+  return TP_JOB_SUCCESS;
+}
+
+static tp_result_t
+outer_task (void *job)
+{
+  (void) job;
+  void **jobs = calloc (NB_INNER_TASKS, sizeof (*jobs));
+  assert (jobs);
+  threadpool_add_tasks (Inner, NB_INNER_TASKS, inner_task, jobs, 0);
+  free (jobs);
+  threadpool_wait_all (Inner);  // Processes inner tasks meanwhile.
+  return TP_JOB_SUCCESS;
+}
+
+int
+main (void)
+{
+  assert (mtx_init (&Mutex, mtx_plain) == thrd_success);
+  struct threadpool *outer = threadpool_create_and_start (NB_OUTER_WORKERS, 0, TP_RUN_ALL_TASKS);
+  Inner = threadpool_create_and_start (NB_INNER_WORKERS, 0, TP_RUN_ALL_TASKS);
+  threadpool_borrow_workers (Inner, outer);
+  threadpool_add_task (outer, outer_task, 0, 0);
+  threadpool_wait_all (outer);
+  threadpool_wait_and_destroy (Inner);
+  threadpool_wait_and_destroy (outer);
+  mtx_destroy (&Mutex);
+  fprintf (stdout, "%zu inner tasks processed by %zu distinct threads (at most %zu, the workers of the outer thread pool).\n",
+           NB_INNER_TASKS, Nb_threads, NB_OUTER_WORKERS);
+  return Nb_threads <= NB_OUTER_WORKERS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,140 @@
+// Compares a data-parallel loop written with threadpool_parallel_for (lazy binary splitting)
+// with a naive loop submitting one task (and one heap-allocated job) per element, and with a sequential loop.
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "wqm.h"
+
+static const size_t NB_ELEMS = 1 << 20;
+static const size_t NB_ROWS = 64;       // For the nested loops.
+
+static double
+elapsed_ms (struct timespec from, struct timespec to)
+{
+  return 1.e3 * difftime (to.tv_sec, from.tv_sec) + 1.e-6 * (double) (to.tv_nsec - from.tv_nsec);
+}
+
+static double
+f (size_t i)
+{
+  double x = (double) i;
+  for (int k = 0; k < 8; k++)
+    x = sqrt (x + 1.);
+  return x;
+}
+
+// ----- Sequential loop
+static void
+body (size_t begin, size_t end, void *arg)
+{
+  double *out = arg;
+  for (size_t i = begin; i < end; i++)
+    out[i] = f (i);
+}
+
+// ----- One task per element
+struct job
+{
+  double *out;
+  size_t i;
+};
+
+static int
+work (void *arg)
+{
+  struct job *job = arg;
+  job->out[job->i] = f (job->i);
+  return EXIT_SUCCESS;
+}
+
+// ----- Nested loops: one task per row, each row processed by a parallel loop.
+struct row
+{
+  struct threadpool *tp;
+  double *out;
+  size_t offset;
+};
+
+static void
+row_body (size_t begin, size_t end, void *arg)
+{
+  struct row *row = arg;
+  for (size_t i = begin; i < end; i++)
+    row->out[row->offset + i] = f (row->offset + i);
+}
+
+static void
+rows_body (size_t begin, size_t end, void *arg)
+{
+  struct row *rows = arg;
+  size_t row_length = NB_ELEMS / NB_ROWS;
+  for (size_t r = begin; r < end; r++)
+  {
+    struct row row = {.tp = rows->tp,.out = rows->out,.offset = r * row_length };
+    threadpool_parallel_for (row.tp, 0, row_length, 256, row_body, &row);       // Nested in a task of the same thread pool.
+  }
+}
+
+static double
+checksum (const double *out)
+{
+  double sum = 0;
+  for (size_t i = 0; i < NB_ELEMS; i++)
+    sum += out[i];
+  return sum;
+}
+
+int
+main (int argc, char *argv[])
+{
+  double *out = calloc (NB_ELEMS, sizeof (*out));
+  double *expected = calloc (NB_ELEMS, sizeof (*expected));
+  if (!out || !expected)
+    return EXIT_FAILURE;
+  struct timespec t0, t1;
+
+  timespec_get (&t0, TIME_UTC);
+  body (0, NB_ELEMS, expected);
+  timespec_get (&t1, TIME_UTC);
+  fprintf (stdout, "%-40s %9.1f ms\n", "Sequential loop:", elapsed_ms (t0, t1));
+
+  struct threadpool *tp = threadpool_create_and_start (argc > 1 ? strtoul (argv[1], 0, 10) : TP_WORKER_NB_CPU, 0, TP_RUN_ALL_TASKS);
+  fprintf (stdout, "(%zu workers, %zu elements)\n", threadpool_nb_workers (tp), NB_ELEMS);
+
+  timespec_get (&t0, TIME_UTC);
+  for (size_t i = 0; i < NB_ELEMS; i++)
+  {
+    struct job *job = malloc (sizeof (*job));
+    if (!job)
+      break;
+    *job = (struct job) {.out = out,.i = i };
+    threadpool_add_task (tp, work, job, threadpool_job_free_handler);
+  }
+  threadpool_wait_all (tp);
+  timespec_get (&t1, TIME_UTC);
+  fprintf (stdout, "%-40s %9.1f ms %s\n", "One task per element:", elapsed_ms (t0, t1), checksum (out) == checksum (expected) ? "" : "(WRONG)");
+
+  for (size_t grain = 1; grain <= 4096; grain *= 64)
+  {
+    for (size_t i = 0; i < NB_ELEMS; i++)
+      out[i] = 0;
+    char title[64];
+    snprintf (title, sizeof (title), "threadpool_parallel_for (grain %zu):", grain);
+    timespec_get (&t0, TIME_UTC);
+    threadpool_parallel_for (tp, 0, NB_ELEMS, grain, body, out);
+    timespec_get (&t1, TIME_UTC);
+    fprintf (stdout, "%-40s %9.1f ms %s\n", title, elapsed_ms (t0, t1), checksum (out) == checksum (expected) ? "" : "(WRONG)");
+  }
+
+  for (size_t i = 0; i < NB_ELEMS; i++)
+    out[i] = 0;
+  timespec_get (&t0, TIME_UTC);
+  threadpool_parallel_for (tp, 0, NB_ROWS, 1, rows_body, &(struct row) {.tp = tp,.out = out });
+  timespec_get (&t1, TIME_UTC);
+  fprintf (stdout, "%-40s %9.1f ms %s\n", "Nested threadpool_parallel_for:", elapsed_ms (t0, t1), checksum (out) == checksum (expected) ? "" : "(WRONG)");
+
+  threadpool_wait_and_destroy (tp);
+  free (out);
+  free (expected);
+}
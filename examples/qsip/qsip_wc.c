@@ -5,6 +5,7 @@
 // Compile options for algorithm:
 // -DFIXED_PIVOT: use a fixed pivot, in the middle of the array to sort (otherwise, a random pivot is used by default, recommended).
 // -DDEBUG: For debugging purpose only.
+// -DAFFINITY=policy: pin workers to CPUs, with policy TP_AFFINITY_ROUND_ROBIN, TP_AFFINITY_COMPACT or TP_AFFINITY_SCATTER (glibc only).
 // Compile options for algorithm:
 // ================= Quick sort in place =================
 #define _DEFAULT_SOURCE         // For initstate_r
@@ -39,15 +40,6 @@ typedef struct
   size_t nmemb;
 } Job;                          // Chunk of an array of elements.
 
-static Job *
-job_create (Job j)
-{
-  Job *pj = malloc (sizeof (*pj));
-  EXEC_OR_ABORT (pj);
-  *pj = j;
-  return pj;
-}
-
 typedef struct                  // Threadpool specific global data
 {
   const size_t elem_size;       // Size of elements of type of *base
@@ -197,19 +189,18 @@ work (void *j)
     lomuto (job, g, l, &p1, &p2);
     TEST_OR_ABORT (p1 >= job->base && p1 < job->base + job->nmemb * g->elem_size);
     TEST_OR_ABORT (p2 >= job->base && p2 < job->base + job->nmemb * g->elem_size);
-    Job *new_job1 = job_create ((Job) {
-                                .base = job->base,.nmemb = (typeof (job->nmemb)) (p1 - job->base) / g->elem_size,
-                                });
-    EXEC_OR_ABORT (new_job1);
-    DPRINTF ("Job         (%1$p, %2$'zu) to be added to jobs ...\n", new_job1->base, new_job1->nmemb);
-    threadpool_add_task (threadpool_current (), work, new_job1, threadpool_job_free_handler);
-    Job *new_job2 = job_create ((Job) {
-                                .base = p2 + g->elem_size,.nmemb = job->nmemb - 1 - ((typeof (job->nmemb)) (p2 - job->base) / g->elem_size),
-                                });
-    EXEC_OR_ABORT (new_job2);
-    DPRINTF ("Job         (%1$p, %2$'zu) to be added to jobs ...\n", new_job2->base, new_job2->nmemb);
-    threadpool_add_task (threadpool_current (), work, new_job2, threadpool_job_free_handler);
+    Job new_job1 = {
+      .base = job->base,.nmemb = (typeof (job->nmemb)) (p1 - job->base) / g->elem_size,
+    };
+    DPRINTF ("Job         (%1$p, %2$'zu) to be added to jobs ...\n", new_job1.base, new_job1.nmemb);
+    EXEC_OR_ABORT (threadpool_spawn (work, &new_job1, sizeof (new_job1)));       // The job is copied in a frame of the worker.
+    Job new_job2 = {
+      .base = p2 + g->elem_size,.nmemb = job->nmemb - 1 - ((typeof (job->nmemb)) (p2 - job->base) / g->elem_size),
+    };
+    DPRINTF ("Job         (%1$p, %2$'zu) to be added to jobs ...\n", new_job2.base, new_job2.nmemb);
+    EXEC_OR_ABORT (threadpool_spawn (work, &new_job2, sizeof (new_job2)));
     DPRINTF ("Job         (%1$p, %2$'zu) made %3$'zu swaps.\n", job->base, job->nmemb, l->nb_swaps);
+    threadpool_sync ();         // Both partitions are sorted (the worker sorts partitions meanwhile).
   }                             // if (data.nmemb >= 2)
   DPRINTF ("Job         (%1$p, %2$'zu) processed.\n", job->base, job->nmemb);
   return 0;
@@ -241,6 +232,10 @@ qsip (void *base, size_t nmemb, size_t size, int (*lt) (const void *, const void
   atomic_init (&global_data.nb_cmp, 0);
   struct threadpool *ThreadPool = threadpool_create_and_start (TP_WORKER_NB_CPU, &global_data, TP_RUN_ALL_TASKS);
   threadpool_set_worker_local_data_manager (ThreadPool, local_data_create, local_data_delete);
+  threadpool_set_work_stealing (ThreadPool, 1);       // Partitions are processed depth-first by the worker which created them.
+#if defined(__GLIBC__) && defined(AFFINITY)
+  threadpool_set_cpu_affinity (ThreadPool, AFFINITY);   // Partitions stay on the CPU (and NUMA node) of the worker which created them.
+#endif
 
   // Feed thread workers.
   Job initial_job = {
@@ -1,20 +1,28 @@
 // Multi-threaded work queue manager
 // (c) L. Farhi, 2024
 // Language: C (C11 or higher)
+#define _GNU_SOURCE             // for sched_setaffinity (glibc)
 #include <stdio.h>
 #include <stdlib.h>
 #include <threads.h>
 #ifdef __GLIBC__
 #  include <sys/sysinfo.h>      // for get_nprocs
+#  include <sched.h>            // for sched_setaffinity
+#  include <pthread.h>          // for pthread_attr_setstacksize (thrd_t is pthread_t)
+#  include <limits.h>           // for PTHREAD_STACK_MIN
+#  include <ucontext.h>         // for makecontext and swapcontext (fibers)
 #endif
 #ifndef thread_local            // C11 compatibility
 #  define thread_local _Thread_local
 #endif
+#include <stdatomic.h>
 #undef atomic
 #define atomic _Atomic
 #include <errno.h>
 #include <time.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 #include <math.h>
 #include "map.h"
 #include "timer.h"
@@ -28,16 +36,30 @@
 #  define i18n_init
 #endif
 
-#define threadpool_something_to_process_predicate(threadpool)   ((threadpool)->out != 0)        // Indicates that the FIFO is not empty.
-// The FIFO is empty and there is not work in progress or virtual (asynchronous) task or new task that could ever fill it (all expected tasks have been processed).
-#define threadpool_is_done_predicate(threadpool)   ( (threadpool)->nb_processing_tasks == 0 && \
+#define threadpool_ring_is_filled(threadpool) ((threadpool)->ring.cell && \
+                                              (threadpool)->ring.cell[(threadpool)->ring.dequeue_pos & (threadpool)->ring.mask].sequence == (threadpool)->ring.dequeue_pos + 1)
+// Indicates that the FIFO, the submission ring or a local deque is not empty.
+#define threadpool_something_to_process_predicate(threadpool)   ((threadpool)->nb_queued_elems != 0 || threadpool_ring_is_filled (threadpool))
+// The FIFO is empty and there is not work in progress or virtual (asynchronous) task (all submitted tasks have been processed).
+#define threadpool_is_idle_predicate(threadpool)   ( (threadpool)->nb_processing_tasks == 0 && \
                                                      !threadpool_something_to_process_predicate (threadpool) && \
-                                                     (threadpool)->concluding && (threadpool)->nb_async_tasks == 0)
+                                                     (threadpool)->nb_async_tasks == 0)
+// A task has succeeded (for TP_RUN_ONE_SUCCESSFUL_TASK) or failed (for TP_RUN_ALL_SUCCESSFUL_TASKS): other tasks are canceled automatically.
+#define threadpool_is_short_circuited_predicate(threadpool) (((threadpool)->property == TP_RUN_ONE_SUCCESSFUL_TASK && (threadpool)->nb_succeeded_tasks) || \
+                                                             ((threadpool)->property == TP_RUN_ALL_SUCCESSFUL_TASKS && (threadpool)->nb_failed_tasks))
+// The thread pool is idle and there is no new task that could ever fill the FIFO (all expected tasks have been processed).
+#define threadpool_is_done_predicate(threadpool)   (threadpool_is_idle_predicate (threadpool) && (threadpool)->concluding)
 // N.B.: Once done, a FIFO cannot be undone by design: there aren't any data being processed left, that could call 'threadpool_add_task' and refill the empty FIFO (see loop in 'thread_worker_starter').
 #define threadpool_runoff_predicate(threadpool) (threadpool_is_done_predicate(threadpool) && (threadpool)->nb_alive_workers == 0)
+// Workers in a blocking region are compensated by as many extra workers. The target number of workers is the requested one, unless adapted (see threadpool_set_adaptive_workers).
+#define threadpool_max_nb_alive_workers(threadpool) ((threadpool)->target_nb_workers + (threadpool)->nb_blocking_workers)
 
 #ifdef __GLIBC__
 size_t const TP_WORKER_NB_CPU = 0;
+const tp_affinity_t TP_AFFINITY_NONE = 0;
+const tp_affinity_t TP_AFFINITY_ROUND_ROBIN = 1;
+const tp_affinity_t TP_AFFINITY_COMPACT = 2;
+const tp_affinity_t TP_AFFINITY_SCATTER = 3;
 #endif
 size_t const TP_WORKER_SEQUENTIAL = 1;
 size_t const TP_CANCEL_ALL_PENDING_TASKS = SIZE_MAX - 2;
@@ -46,6 +68,10 @@ size_t const TP_CANCEL_LAST_PENDING_TASK = SIZE_MAX;
 const tp_property_t TP_RUN_ALL_TASKS = 1;       // Runs all submitted tasks.
 const tp_property_t TP_RUN_ALL_SUCCESSFUL_TASKS = 2;    // Runs submitted tasks until one fails. Cancel automatically other (already or to be) submitted tasks.
 const tp_property_t TP_RUN_ONE_SUCCESSFUL_TASK = 4;     // Runs submitted tasks until one succeeds. Cancel automatically other (already or to be) submitted tasks.
+
+const tp_backpressure_t TP_BACKPRESSURE_BLOCK = 1;      // The producer waits.
+const tp_backpressure_t TP_BACKPRESSURE_FAIL = 2;       // The submission fails (with errno set to EAGAIN).
+const tp_backpressure_t TP_BACKPRESSURE_RUN_INLINE = 3; // The producer processes the task itself.
 const tp_result_t TP_JOB_SUCCESS = 0;
 const tp_result_t TP_JOB_FAILURE = 1;
 const tp_result_t TP_JOB_CANCELED = 2;
@@ -54,7 +80,48 @@ struct threadpool
 {
   tp_property_t property;
   size_t requested_nb_workers, max_nb_workers;
-  thrd_t *worker_id /* [requested_nb_workers] */ ;
+  size_t nb_slots;              // Number of worker slots: the requested workers, and as many compensating workers (see threadpool_blocking_begin).
+  size_t nb_used_slots;         // Number of worker slots ever registered, the lowest ones first: the slots beyond are scanned by no loop.
+  size_t atomic nb_blocking_workers;    // Number of workers in a blocking region, compensated by as many extra workers.
+  size_t atomic target_nb_workers;      // Number of workers to be kept alive (if there are tasks to process), at most requested_nb_workers.
+  struct                        // Hill-climbing controller of the target number of workers (see threadpool_set_adaptive_workers).
+  {
+    size_t min, max;            // Bounds of the target number of workers (max is 0 if the controller is disabled).
+    struct timespec time;       // Time of the last sample.
+    size_t nb_completed;        // Number of completed tasks at the last sample.
+    double throughput;          // Completed tasks per second, over the last sampling interval.
+    int direction;              // +1 if the target number of workers was last raised, -1 if lowered.
+  } controller;
+  struct worker                 // Worker slots.
+  {
+    thrd_t id;
+    int active;
+    struct threadpool *threadpool;
+    mtx_t mutex;                // Guards the local deque (and nothing else).
+    struct elem *top, *bottom;  // Local deque (work-stealing): the owner pushes and pops at the top (LIFO), thieves steal at the bottom (FIFO).
+    size_t atomic nb_elems;     // Number of elements in the local deque.
+    struct elem *free_elems;    // Cache of free elements (only used by the worker running in the slot, without locking).
+    size_t nb_free_elems;
+    int atomic cpu;             // CPU the worker is pinned to (-1 if not pinned).
+    size_t node;                // NUMA node of the CPU.
+    cnd_t wake_up;              // Parking slot: signalled to wake up the worker when it waits for a task (or for the end of work).
+    int parked;
+    struct future *waited_future;       // Future of a task the worker waits for (in threadpool_task_wait), while parked.
+    struct worker *next_to_be_spawned;  // Registered workers to be started by the spawner thread (see threadpool_set_min_workers).
+    int waits_for_idle;         // Set if the worker waits for the thread pool to be idle (in threadpool_wait_all), while parked.
+    struct task *syncing;       // Task whose spawned children the worker waits for (in threadpool_sync), while parked.
+    struct frame_chunk          // Stack of frames of spawned tasks (see threadpool_spawn), only used by the worker running in the slot, without locking.
+    {
+      struct frame_chunk *prev;
+      size_t size, top;         // In units of max_align_t.
+      max_align_t data[];
+    } *frames, *spare_frames;   // Top chunk of the stack, and a free chunk kept for reuse.
+    struct worker *parked_prev, *parked_next;   // List of parked workers.
+    size_t stack_size;          // Size of the stack of the thread running in the slot (0 if unknown).
+    size_t blocking;            // Nesting level of the blocking regions the worker is in (see threadpool_blocking_begin).
+  } *worker /* [nb_slots] */ ;
+  struct worker **free_slots /* [nb_slots] */ ; // Stack of inactive worker slots, the most recently freed on top.
+  size_t nb_free_slots;
   mtx_t mutex;
   void *global_data;
   struct                        // Thread specific local data
@@ -62,28 +129,127 @@ struct threadpool
     void *(*make) (void);
     void (*destroy) (void *local_data);
   } worker_local_data_manager;
-  size_t nb_alive_workers, nb_idle_workers, nb_created_workers;
-  size_t atomic nb_created_tasks, nb_submitted_tasks, nb_pending_tasks, nb_async_tasks, nb_processing_tasks, nb_succeeded_tasks, nb_failed_tasks, nb_canceled_tasks;
-  thrd_t **active_worker_id /* [requested_nb_workers] */ ;
-  struct elem                   // Elements in FIFO.
+  size_t nb_created_workers;
+  size_t nb_reaped_workers;     // Number of workers ended before the thread pool is done (idle or surplus workers).
+  size_t atomic nb_alive_workers, nb_idle_workers;
+  size_t atomic nb_created_tasks, nb_submitted_tasks, nb_pending_tasks, nb_async_tasks, nb_processing_tasks, nb_succeeded_tasks, nb_failed_tasks, nb_canceled_tasks, nb_expired_tasks;
+  size_t atomic nb_queued_elems;        // Number of elements in the FIFOs, in the local deques, in the canceled elements and in the resumed tasks.
+  struct                        // Lock-free submission ring (bounded, Vyukov-style), used before the FIFO if allocated.
   {
-    struct elem *next;
-    struct task                 // Task to be processed by a worker.
+    struct cell
     {
-      struct job
+      size_t atomic sequence;   // Equal to the position of the cell if free, to the position + 1 if filled.
+      struct elem *atomic elem;
+    } *cell /* [mask + 1] */ ;
+    size_t mask;
+    size_t atomic enqueue_pos;  // Multiple producers.
+    size_t dequeue_pos;         // Consumers are serialised by threadpool->mutex.
+  } ring;
+  struct                        // Slab allocator of elements.
+  {
+    mtx_t mutex;                // Guards the list of slabs and the shared free list.
+    struct slab *slabs;
+    struct elem *free_elems;    // Shared free list.
+    size_t atomic nb_bytes;     // Memory allocated for slabs.
+  } slab;
+  size_t nb_numa_nodes;         // Number of NUMA nodes the workers are placed on.
+  int atomic work_stealing;     // Tasks submitted by a worker are pushed to its local deque rather than to the FIFO.
+  struct queue                  // FIFOs of tasks, one per priority level.
+  {
+    struct elem                 // Elements in FIFO (or in a local deque).
+    {
+      struct elem *next, *prev; // Towards the most recently and the least recently queued elements.
+      struct task               // Task to be processed by a worker.
       {
-        void *data;
-          tp_result_t (*data_delete) (void *data, tp_result_t result);
-      } job;
-        tp_result_t (*work) (void *data);
-      size_t id;
-      int to_be_continued;
-      int is_continuation;
-    } task;
-  } *in, *out;
+        struct job
+        {
+          void *data;
+            tp_result_t (*data_delete) (void *data, tp_result_t result);
+        } job;
+          tp_result_t (*work) (void *data);
+        size_t id;
+        int to_be_continued;
+        int is_continuation;
+        struct future *future;  // Completion record of the task (0 if futures are disabled).
+        size_t nb_predecessors; // Number of tasks to be completed before the task can be queued (see threadpool_add_task_after).
+        int predecessor_failed; // A predecessor was canceled (or has failed, for TP_RUN_ALL_SUCCESSFUL_TASKS): the task will be canceled.
+        int atomic cancel_requested;    // The running task is asked to stop (see threadpool_task_cancel_requested).
+        struct task *parent;    // Running task which spawned the task (see threadpool_spawn), 0 otherwise.
+        size_t atomic nb_children;      // Number of spawned children not completed yet.
+        int spawned;            // Set if the task has spawned children since it last called threadpool_sync.
+        void *frames;           // Top of the stack of frames of the worker before the first of those children was spawned.
+        struct fiber *fiber;    // User-mode context the task runs on, once started (see threadpool_set_fibers), 0 otherwise.
+      } task;
+      struct timespec time;     // Deadline of a task with a deadline, wake-up time of a sleeping task, time of queueing in a FIFO otherwise (only set if priorities are aged).
+      struct queue *queue;      // Indexed queue the element is linked in (0 if none, see threadpool_index_insert).
+      struct elem *index_next;  // Next element in the same bucket of the index.
+    } *in, *out;
+    size_t atomic nb_elems;
+  } fifo[TP_NB_PRIORITY_LEVELS];
+  struct queue deadlines;       // Tasks with a deadline, sorted by earliest deadline first (rather than a FIFO).
+  struct queue blocked;         // Tasks waiting for the completion of their predecessors, in submission order.
+  struct queue running;         // Elements of the tasks being processed (not indexed).
+  struct queue canceled;        // Canceled elements, unlinked from their queues, to be completed at once by a worker (see threadpool_complete_canceled).
+  struct                        // Tasks run on fibers (see threadpool_set_fibers).
+  {
+    size_t stack_size;          // Size of the stack of a fiber (0 if tasks are run on the threads of the workers).
+    struct fiber *free;         // Fibers kept for reuse.
+    size_t nb_free;
+    struct queue sleeping;      // Suspended tasks, sorted by earliest wake-up time first (not indexed).
+    struct queue resumed;       // Suspended tasks ready to be resumed, in order (not indexed).
+  } fibers;
+  struct                        // Elements of the FIFOs, of the deadlines and of the blocked tasks, by task id (see threadpool_cancel_task).
+  {
+    struct elem **bucket /* [mask + 1] */ ;
+    size_t mask;
+    size_t nb_elems;
+  } index;
+  struct                        // Completion records of tasks, by task id (see threadpool_task_wait).
+  {
+    map *map;                   // 0 if futures are disabled.
+    cnd_t completed;            // Signalled when a task waited for by a thread other than a worker of the thread pool is completed.
+  } futures;
+  double priority_aging;        // Delay after which a task waiting in a FIFO is moved up to the next priority level, in seconds (0 if disabled).
   int concluding;               // Indicates that 'threadpool_wait_and_destroy' has been called. Only workers can now add tasks (in 'thread_worker_starter').
-  cnd_t proceed_or_conclude_or_runoff;  // Associated with 3 exclusive predicates.
+  struct worker *parked;        // Parked (idle) workers, most recently parked first. Guarded by threadpool->mutex.
+  struct threadpool *lender;    // Thread pool whose workers process the tasks, rather than new threads (see threadpool_borrow_workers).
+  size_t atomic nb_references;  // The thread pool is freed when released by its owner (threadpool_wait_and_destroy) and by all the guest tasks submitted to the lender.
+  cnd_t runoff;                 // Signalled when the predicate threadpool_runoff_predicate is fulfilled.
+  cnd_t idle;                   // Signalled when the predicate threadpool_is_idle_predicate is fulfilled, if waited for (by threadpool_wait_all).
+  size_t nb_idle_waiters;
   double idle_timeout;          // Timeout delay of an inactive worker, in seconds.
+  double idle_spin;             // Delay an inactive worker polls for new tasks before it parks, in seconds.
+  size_t min_workers;           // Number of warm workers, which are never ended by the idle timeout.
+  struct                        // Hysteresis of the retirement of idle workers (see threadpool_set_idle_retirement).
+  {
+    size_t floor;               // Number of alive workers which are never ended by the idle timeout (without being started at once, unlike warm workers).
+    double max_delay;           // Maximum delay between two retirements, in seconds (0 if idle workers retire after the idle timeout independently).
+    struct timespec time;       // Time of the last retirement.
+    unsigned int nb;            // Number of retirements since a worker was last created.
+  } retirement;
+  struct                        // Attributes of the threads of the workers (see threadpool_set_worker_stack).
+  {
+    size_t size, guard_size;    // 0 for the default sizes (a guard page is kept by default).
+    int set;
+    size_t atomic nb_bytes;     // Stack memory reserved for the alive workers.
+  } stack;
+  struct                        // Backpressure on producers (see threadpool_set_max_pending).
+  {
+    size_t atomic max_pending;  // Maximum number of pending tasks (0 if unbounded).
+    tp_backpressure_t atomic policy;
+    cnd_t not_full;             // Signalled when the number of pending tasks drops below max_pending, if waited for.
+    size_t nb_waiters;
+    size_t atomic nb_throttled; // Number of submissions throttled.
+    double waiting_time;        // Time spent by producers waiting, in seconds.
+  } backpressure;
+  struct                        // Thread starting workers on behalf of the submitters (see threadpool_set_min_workers).
+  {
+    thrd_t id;
+    int started, quit;
+    cnd_t request;              // Signalled when workers are to be started (or when the spawner should quit).
+    struct worker *workers;     // Registered workers to be started.
+    size_t nb_workers;
+  } spawner;
   struct
   {
     void *(*allocator) (void *global_data);
@@ -102,12 +268,42 @@ struct threadpool
   } monitor;
 };
 
-static thread_local struct      // Thread local worker-specific storage (see also Jens Gustedt, https://stackoverflow.com/a/58087826).
+struct future                   // Completion record of a task, reclaimed after its result has been retrieved, or at completion if detached.
+{
+  size_t id;
+  tp_result_t result;
+  int done;
+  int detached;                 // Its result won't be retrieved (see threadpool_task_detach).
+  size_t nb_waiters;
+  int reclaimed;                // Removed from the map while still waited for: released by the last waiter.
+  struct successor              // Blocked tasks waiting for the completion of the task.
+  {
+    struct elem *elem;
+    struct successor *next;
+  } *successors;
+};
+
+struct slab                     // Chunk of elements.
+{
+  struct slab *next;
+  struct elem elem[];
+};
+static const size_t SLAB_NB_ELEMS = 256;        // Number of elements per slab.
+static const size_t WORKER_CACHE_NB_ELEMS = 64; // Number of free elements exchanged at once between the cache of a worker and the shared free list.
+static const size_t INDEX_MIN_NB_BUCKETS = 1024;        // Initial number of buckets of the index of elements (a power of 2).
+static const size_t FRAME_CHUNK_NB_UNITS = 4096;        // Size of a chunk of the stack of frames of a worker, in units of max_align_t.
+static const size_t FIBER_MIN_STACK_SIZE = 16384;       // Minimum size of the stack of a fiber, in bytes.
+static const double CONTROLLER_INTERVAL = 0.1;  // Sampling interval of the throughput by the controller of the number of workers, in seconds.
+static const double CONTROLLER_NOISE = 0.05;    // Relative change of the throughput below which it is considered unchanged.
+
+static thread_local struct worker_context       // Thread local worker-specific storage (see also Jens Gustedt, https://stackoverflow.com/a/58087826).
 {
   struct threadpool *threadpool;        // thread pool in which a worker is running
+  struct worker *worker;        // slot of the worker in the thread pool
   void *local_data;
   struct task *current_task;
   size_t worker_no;
+  size_t nb_guards;             // Nesting of threadpool_guard_begin: the task holds the lock of the thread pool and must not be suspended.
 } Worker_context = { 0 };
 
 static once_flag THREADPOOL_INIT = ONCE_FLAG_INIT;
@@ -115,7 +311,7 @@ static once_flag THREADPOOL_INIT = ONCE_FLAG_INIT;
 // ================= Continuators =================
 struct continuator_data
 {
-  struct job job;
+  struct task task;             // Continued task.
   int (*work) (void *data);
   uint64_t uid;
   void *timeout_timer;
@@ -161,24 +357,36 @@ continuators_clear_on_exit (void)
 }
 
 static size_t threadpool_create_task (struct threadpool *threadpool, tp_result_t (*work) (void *job), void *job, tp_result_t (*job_delete) (void *job, tp_result_t result),
-                                      int is_continuation);
+                                      const struct task *continued, size_t priority, const struct timespec *deadline, struct task *parent);
+static size_t threadpool_wake_up_parked_workers (struct threadpool *threadpool, size_t nb);
+static void threadpool_wake_up_or_start_workers (struct threadpool *threadpool, size_t nb_elems);
+static void threadpool_complete_canceled (struct threadpool *threadpool);
+static void threadpool_child_complete (struct threadpool *threadpool, struct task *task);
+static void threadpool_task_sync (struct threadpool *threadpool, struct task *task);
+static void threadpool_frame_pop (struct worker *worker, void *top);
+static int future_reclaim_operator (void *data, void *res, int *remove);
 
 static int
 threadpool_task_continuator_continue_operator (void *data, void *res, int *remove)
 {
   struct continuator_data *continuator = data;
   if (!threadpool_create_task (continuator->threadpool, (res ? continuator->work /* finalise */ : 0 /* timeout: cancel */ ),
-                               continuator->job.data, continuator->job.data_delete, /* is_continuation = */ 1))
+                               continuator->task.job.data, continuator->task.job.data_delete, /* continued = */ &continuator->task, /* priority = */ 0, /* deadline = */ 0,
+                               /* parent = */ 0))
   {
     fprintf (stderr, "%s: %s\n", __func__, _("Continuation failed."));
     continuator->threadpool->nb_failed_tasks++;
     return 0;
   }
   // Remove the asynchronous task (after the continuator has been converted into a task to keep threadpool_is_done_predicate true).
-  assert (continuator->threadpool->nb_async_tasks--);
-  // Broadcast (but not before the continuator has been converted into a task).
+  // A worker has already been woken up to process the task.
+  struct threadpool *threadpool = continuator->threadpool;
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  assert (threadpool->nb_async_tasks--);
+  if (!threadpool->nb_async_tasks)      // Workers parked without timeout while there were asynchronous tasks are woken up, to park again with a timeout.
+    threadpool_wake_up_parked_workers (threadpool, SIZE_MAX);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
   timer_unset (continuator->timeout_timer);
-  thrd_honored (cnd_broadcast (&continuator->threadpool->proceed_or_conclude_or_runoff));
   // continuator->p_uid is NOT free'd.
   free (continuator);           // Remove the continuator.
   *remove = 1;                  // Remove the continuator from the map.
@@ -237,7 +445,7 @@ threadpool_task_continuation (tp_result_t (*work) (void *data), double seconds)
     errno = ENOMEM;
     return 0;
   }
-  continuator->job = Worker_context.current_task->job;
+  continuator->task = *Worker_context.current_task;
   continuator->work = work;
   struct timespec abs_timeout = delay_to_abs_timespec (seconds > 0 ? seconds : 0);      // from timers.h
   continuator->threadpool = Worker_context.threadpool;
@@ -253,6 +461,13 @@ threadpool_task_continuation (tp_result_t (*work) (void *data), double seconds)
   return continuator->uid;
 }
 
+static double
+elapsed_seconds (const struct timespec *from, const struct timespec *to)
+{
+  return difftime (to->tv_sec, from->tv_sec)    // type of tv_sec is time_t, difftime does not overflow
+    + 1.e-9 * (double) (to->tv_nsec - from->tv_nsec);   // tv_nsec is signed.
+}
+
 // ================= Monitoring =================
 static tp_result_t
 threadpool_monitor_exec (void *data)
@@ -278,16 +493,28 @@ threadpool_monitor_call (struct threadpool *threadpool, int force)
   {
     struct threadpool_monitor v = {.threadpool = threadpool,.closed = threadpool->concluding,
       .workers = {.nb_requested = threadpool->requested_nb_workers,.nb_max = threadpool->max_nb_workers,
-                  .nb_idle = threadpool->nb_idle_workers,.nb_alive = threadpool->nb_alive_workers,},
+                  .nb_idle = threadpool->nb_idle_workers,.nb_alive = threadpool->nb_alive_workers,
+                  .nb_target = threadpool->target_nb_workers,.throughput = threadpool->controller.throughput,
+                  .nb_created = threadpool->nb_created_workers,.nb_reaped = threadpool->nb_reaped_workers,
+                  .nb_blocking = threadpool->nb_blocking_workers,
+                  .nb_compensating = threadpool->nb_alive_workers > threadpool->requested_nb_workers ? threadpool->nb_alive_workers - threadpool->requested_nb_workers : 0,},
       .tasks = {.nb_submitted = threadpool->nb_submitted_tasks,
                 .nb_processing = threadpool->nb_processing_tasks,.nb_asynchronous = threadpool->nb_async_tasks,
                 .nb_succeeded = threadpool->nb_succeeded_tasks,.nb_failed = threadpool->nb_failed_tasks,
-                .nb_pending = threadpool->nb_pending_tasks,.nb_canceled = threadpool->nb_canceled_tasks,},
+                .nb_pending = threadpool->nb_pending_tasks,.nb_canceled = threadpool->nb_canceled_tasks,
+                .nb_expired = threadpool->nb_expired_tasks,.nb_with_deadline = threadpool->deadlines.nb_elems,
+                .nb_blocked = threadpool->blocked.nb_elems,.nb_throttled = threadpool->backpressure.nb_throttled,
+                .throttled_waiting_time = threadpool->backpressure.waiting_time,},
+      .memory = {.nb_slab_bytes = threadpool->slab.nb_bytes,.nb_stack_reserved_bytes = threadpool->stack.nb_bytes,},
     };
+    v.tasks.nb_queued[0] = threadpool->nb_queued_elems - threadpool->deadlines.nb_elems - threadpool->canceled.nb_elems;      // Tasks without priority also wait in the local deques and in the submission ring.
+    for (size_t level = 1; level < TP_NB_PRIORITY_LEVELS; level++)
+      v.tasks.nb_queued[0] -= (v.tasks.nb_queued[level] = threadpool->fifo[level].nb_elems);
+    if (threadpool->ring.cell)
+      v.tasks.nb_queued[0] += threadpool->ring.enqueue_pos - threadpool->ring.dequeue_pos;
     struct timespec t;
     timespec_get (&t, TIME_UTC);        // C standard function, returns now.
-    v.time = difftime (t.tv_sec, threadpool->monitor.t0.tv_sec) // type of tv_sec is time_t, difftime does not overflow
-      + 1.e-9 * (double) (t.tv_nsec - threadpool->monitor.t0.tv_nsec);  // tv_nsec is signed.
+    v.time = elapsed_seconds (&threadpool->monitor.t0, &t);
     if (!threadpool->monitor.filter)
       force = 0;
     if (!force && threadpool->monitor.filter && !threadpool->monitor.filter (v))
@@ -348,10 +575,12 @@ threadpool_monitor_to_terminal (struct threadpool_monitor data, void *FILE_strea
     fprintf (f, "%s\n", _("[Thread pool UID][Elapsed seconds][Thread pool state (Nb alive workers/Nb allocated workers)][Nb submitted tasks] Tasks..."));
     fprintf (f, "     %s\n", _("Thread pool states: (R) running, (I) idle, (S) stopped."));
     fprintf (f, "     %s\n", _("Tasks             : (=) succeeded, (X) failed, (?) asynchronous, (*) processing, (.) pending, (/) canceled."));
+    fprintf (f, "     %s\n", _("Workers           : (+) created, (-) reaped before the thread pool is done."));
     legend = 1;
   }
-  fprintf (f, "[%p][% 10.4fs][%c (%zu/%zu)][%4zu] ", data.threadpool, data.time,
-           data.tasks.nb_processing ? 'R' : data.workers.nb_idle ? 'I' : 'S', data.workers.nb_alive, data.workers.nb_max, data.tasks.nb_submitted);
+  fprintf (f, "[%p][% 10.4fs][%c (%zu/%zu) +%zu -%zu][%4zu] ", data.threadpool, data.time,
+           data.tasks.nb_processing ? 'R' : data.workers.nb_idle ? 'I' : 'S', data.workers.nb_alive, data.workers.nb_max,
+           data.workers.nb_created, data.workers.nb_reaped, data.tasks.nb_submitted);
   for (size_t j = 0; j < sizeof (datas) / sizeof (*datas); j++)
     for (size_t i = 0; i < datas[j].upper; i++)
       fprintf (f, "%c", datas[j].c);
@@ -373,6 +602,102 @@ threadpool_monitor_every_100ms (struct threadpool_monitor d)
   return 0;
 }
 
+// ================= CPU topology =================
+#ifdef __GLIBC__
+static once_flag TOPOLOGY_INIT = ONCE_FLAG_INIT;
+static struct
+{
+  cpu_set_t allowed;            // CPUs allowed to the process.
+  size_t nb_cpus;               // Number of allowed CPUs (0 if unknown).
+  int by_id[CPU_SETSIZE];       // Allowed CPUs, by id.
+  int by_node[CPU_SETSIZE];     // Allowed CPUs, by NUMA node, then by id.
+  size_t node[CPU_SETSIZE];     // NUMA node (numbered from 0 in the order of by_node) of each CPU.
+  size_t nb_nodes;              // Number of NUMA nodes with allowed CPUs.
+  size_t node_first[CPU_SETSIZE], node_nb_cpus[CPU_SETSIZE];    // Allowed CPUs of each node in by_node.
+} Topology;
+
+// Reads a list of ids, as "0-3,8-11" (see cpuset(7)).
+static void
+cpulist_parse (const char *path, cpu_set_t *set)
+{
+  CPU_ZERO (set);
+  FILE *f = fopen (path, "r");
+  if (!f)
+    return;
+  for (int first, last, c; fscanf (f, "%d", &first) == 1;)
+  {
+    last = first;
+    if ((c = fgetc (f)) == '-')
+    {
+      if (fscanf (f, "%d", &last) != 1)
+        break;
+      c = fgetc (f);
+    }
+    for (int id = first; id >= 0 && id <= last && id < CPU_SETSIZE; id++)
+      CPU_SET (id, set);
+    if (c != ',')
+      break;
+  }
+  fclose (f);
+}
+
+static void
+topology_init (void)            // Called once.
+{
+  if (sched_getaffinity (0, sizeof (Topology.allowed), &Topology.allowed))
+    return;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET (cpu, &Topology.allowed))
+      Topology.by_id[Topology.nb_cpus++] = cpu;
+  cpu_set_t nodes, cpus;
+  cpulist_parse ("/sys/devices/system/node/online", &nodes);
+  size_t nb = 0;
+  for (int node = 0; node < CPU_SETSIZE; node++)
+    if (CPU_ISSET (node, &nodes))
+    {
+      char path[64];
+      snprintf (path, sizeof (path), "/sys/devices/system/node/node%d/cpulist", node);
+      cpulist_parse (path, &cpus);
+      CPU_AND (&cpus, &cpus, &Topology.allowed);
+      if (!CPU_COUNT (&cpus))
+        continue;
+      Topology.node_first[Topology.nb_nodes] = nb;
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET (cpu, &cpus) && nb < Topology.nb_cpus)
+        {
+          Topology.by_node[nb++] = cpu;
+          Topology.node[cpu] = Topology.nb_nodes;
+        }
+      Topology.node_nb_cpus[Topology.nb_nodes] = nb - Topology.node_first[Topology.nb_nodes];
+      Topology.nb_nodes++;
+    }
+  if (nb != Topology.nb_cpus)   // Unknown NUMA topology: a single node is assumed.
+  {
+    for (size_t i = 0; i < Topology.nb_cpus; i++)
+      Topology.node[Topology.by_node[i] = Topology.by_id[i]] = 0;
+    Topology.nb_nodes = 1;
+    Topology.node_first[0] = 0;
+    Topology.node_nb_cpus[0] = Topology.nb_cpus;
+  }
+}
+
+// Pins the calling worker to its CPU. Called by the worker itself, before its local data are created, so that they are allocated on its NUMA node (first touch).
+static void
+threadpool_worker_pin (struct worker *worker)
+{
+  int cpu = worker->cpu;
+  if (cpu >= 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO (&set);
+    CPU_SET (cpu, &set);
+    sched_setaffinity (0, sizeof (set), &set);
+  }
+  else if (Topology.nb_cpus)    // The worker could have inherited the affinity of a pinned worker of another thread pool that created it.
+    sched_setaffinity (0, sizeof (Topology.allowed), &Topology.allowed);
+}
+#endif
+
 // ================= Worker crew =================
 static void
 threadpool_clear_on_exit (void)
@@ -404,21 +729,99 @@ threadpool_create_and_start (size_t nb_workers, void *global_data, tp_property_t
     }
   threadpool->property = property;
   threadpool->requested_nb_workers = nb_workers;
-  if (!(threadpool->worker_id = malloc (threadpool->requested_nb_workers * sizeof (*threadpool->worker_id))))
+  threadpool->nb_slots = nb_workers <= SIZE_MAX / 2 / sizeof (*threadpool->worker) ? 2 * nb_workers : nb_workers;
+  threadpool->nb_blocking_workers = 0;
+  threadpool->target_nb_workers = nb_workers;
+  threadpool->controller.min = threadpool->controller.max = 0;
+  threadpool->controller.nb_completed = 0;
+  threadpool->controller.throughput = 0.;
+  threadpool->controller.direction = -1;
+  if (!(threadpool->index.bucket = calloc (INDEX_MIN_NB_BUCKETS, sizeof (*threadpool->index.bucket))))        // All set to 0.
+    goto on_error;
+  threadpool->index.mask = INDEX_MIN_NB_BUCKETS - 1;
+  threadpool->index.nb_elems = 0;
+  if (!(threadpool->worker = calloc (threadpool->nb_slots, sizeof (*threadpool->worker))))    // All set to 0.
     goto on_error;
-  if (!(threadpool->active_worker_id = calloc (threadpool->requested_nb_workers, sizeof (*threadpool->active_worker_id))))      // All set to 0.
+  if (!(threadpool->free_slots = malloc (threadpool->nb_slots * sizeof (*threadpool->free_slots))))
     goto on_error;
+  for (size_t i = 0; i < threadpool->nb_slots; i++)
+  {
+    threadpool->worker[i].threadpool = threadpool;
+    threadpool->worker[i].cpu = -1;
+    threadpool->worker[i].node = 0;
+    thrd_honored (mtx_init (&threadpool->worker[i].mutex, mtx_plain));
+    thrd_honored (cnd_init (&threadpool->worker[i].wake_up));
+  }
+  for (size_t i = 0; i < threadpool->nb_slots; i++)
+    threadpool->free_slots[i] = &threadpool->worker[threadpool->nb_slots - 1 - i];      // The first slot on top.
+  threadpool->nb_free_slots = threadpool->nb_slots;
+  threadpool->nb_used_slots = 0;
   thrd_honored (mtx_init (&threadpool->mutex, mtx_plain | mtx_recursive));
-  thrd_honored (cnd_init (&threadpool->proceed_or_conclude_or_runoff));
+  thrd_honored (cnd_init (&threadpool->runoff));
+  thrd_honored (cnd_init (&threadpool->idle));
+  thrd_honored (cnd_init (&threadpool->spawner.request));
+  threadpool->nb_idle_waiters = 0;
+  threadpool->parked = 0;
+  threadpool->lender = 0;
+  threadpool->nb_references = 1;        // Owner.
+  thrd_honored (mtx_init (&threadpool->slab.mutex, mtx_plain));
+  threadpool->slab.slabs = 0;
+  threadpool->slab.free_elems = 0;
+  threadpool->slab.nb_bytes = 0;
   threadpool->global_data = global_data;
   threadpool->worker_local_data_manager.make = 0;
   threadpool->worker_local_data_manager.destroy = 0;
-  threadpool->in = threadpool->out = 0;
+  for (size_t level = 0; level < TP_NB_PRIORITY_LEVELS; level++)
+  {
+    threadpool->fifo[level].in = threadpool->fifo[level].out = 0;
+    threadpool->fifo[level].nb_elems = 0;
+  }
+  threadpool->deadlines.in = threadpool->deadlines.out = 0;
+  threadpool->deadlines.nb_elems = 0;
+  threadpool->blocked.in = threadpool->blocked.out = 0;
+  threadpool->blocked.nb_elems = 0;
+  threadpool->canceled.in = threadpool->canceled.out = 0;
+  threadpool->canceled.nb_elems = 0;
+  threadpool->running.in = threadpool->running.out = 0;
+  threadpool->running.nb_elems = 0;
+  threadpool->fibers.stack_size = 0;
+  threadpool->fibers.free = 0;
+  threadpool->fibers.nb_free = 0;
+  threadpool->fibers.sleeping.in = threadpool->fibers.sleeping.out = 0;
+  threadpool->fibers.sleeping.nb_elems = 0;
+  threadpool->fibers.resumed.in = threadpool->fibers.resumed.out = 0;
+  threadpool->fibers.resumed.nb_elems = 0;
+  threadpool->futures.map = 0;
+  thrd_honored (cnd_init (&threadpool->futures.completed));
+  threadpool->priority_aging = 0;
+  threadpool->nb_queued_elems = 0;
+  threadpool->ring.cell = 0;
+  threadpool->work_stealing = 0;
+  threadpool->nb_numa_nodes = 1;
   threadpool->concluding = 0;
-  threadpool->max_nb_workers = threadpool->nb_alive_workers = threadpool->nb_idle_workers = threadpool->nb_created_workers = 0;
+  threadpool->max_nb_workers = threadpool->nb_alive_workers = threadpool->nb_idle_workers = threadpool->nb_created_workers = threadpool->nb_reaped_workers = 0;
   threadpool->nb_created_tasks = threadpool->nb_processing_tasks = threadpool->nb_succeeded_tasks =
-    threadpool->nb_async_tasks = threadpool->nb_failed_tasks = threadpool->nb_pending_tasks = threadpool->nb_submitted_tasks = threadpool->nb_canceled_tasks = 0;
+    threadpool->nb_async_tasks = threadpool->nb_failed_tasks = threadpool->nb_pending_tasks = threadpool->nb_submitted_tasks = threadpool->nb_canceled_tasks =
+    threadpool->nb_expired_tasks = 0;
   threadpool->idle_timeout = 0.1;       // seconds.
+  threadpool->idle_spin = 0;    // seconds.
+  threadpool->min_workers = 0;
+  threadpool->retirement.floor = 0;
+  threadpool->retirement.max_delay = 0.;
+  threadpool->retirement.time = (struct timespec) { 0 };
+  threadpool->retirement.nb = 0;
+  threadpool->stack.size = threadpool->stack.guard_size = 0;
+  threadpool->stack.set = 0;
+  threadpool->stack.nb_bytes = 0;
+  threadpool->backpressure.max_pending = 0;
+  threadpool->backpressure.policy = TP_BACKPRESSURE_BLOCK;
+  thrd_honored (cnd_init (&threadpool->backpressure.not_full));
+  threadpool->backpressure.nb_waiters = 0;
+  threadpool->backpressure.nb_throttled = 0;
+  threadpool->backpressure.waiting_time = 0.;
+  threadpool->spawner.started = threadpool->spawner.quit = 0;
+  threadpool->spawner.workers = 0;
+  threadpool->spawner.nb_workers = 0;
   threadpool->resource.data = 0;
   threadpool->resource.allocator = 0;
   threadpool->resource.deallocator = 0;
@@ -434,10 +837,8 @@ on_error:
   errno = ENOMEM;
   if (threadpool)
   {
-    if (threadpool->worker_id)
-      free (threadpool->worker_id);
-    if (threadpool->active_worker_id)
-      free (threadpool->active_worker_id);
+    free (threadpool->index.bucket);
+    free (threadpool->worker);
     free (threadpool);
   }
   return 0;
@@ -449,255 +850,2883 @@ threadpool_nb_workers (struct threadpool *threadpool)
   return threadpool->requested_nb_workers;
 }
 
-static int
-thread_worker_runner (void *args)
+// Elements are linked from the least recently queued (out or bottom) to the most recently queued (in or top).
+static void
+elem_push (struct elem **newest, struct elem **oldest, struct elem *elem)
 {
-  thrd_detach (thrd_current ());        // Asks for disposing of any resources allocated to the worker thread when it terminates.
-  struct threadpool *threadpool = args;
-  Worker_context.threadpool = threadpool;       // Thread local variable
-  thrd_honored (mtx_lock (&threadpool->mutex));
-  Worker_context.worker_no = ++threadpool->nb_created_workers;
-  Worker_context.local_data = threadpool->worker_local_data_manager.make ? threadpool->worker_local_data_manager.make () : 0;   // Call to threadpool->worker_local_data.make is thread-safe.
-  while (1)                     // Looping on tasks (concurrently with other workers)
+  elem->next = 0;
+  if ((elem->prev = *newest))
+    (*newest)->next = elem;
+  else
+    *oldest = elem;
+  *newest = elem;
+}
+
+static struct elem *
+elem_pop_oldest (struct elem **newest, struct elem **oldest)
+{
+  struct elem *elem = *oldest;
+  if (elem && !(*oldest = elem->next))
+    *newest = 0;
+  else if (elem)
+    (*oldest)->prev = 0;
+  return elem;
+}
+
+static struct elem *
+elem_pop_newest (struct elem **newest, struct elem **oldest)
+{
+  struct elem *elem = *newest;
+  if (elem && !(*newest = elem->prev))
+    *oldest = 0;
+  else if (elem)
+    (*newest)->next = 0;
+  return elem;
+}
+
+static void
+elem_unlink (struct elem **newest, struct elem **oldest, struct elem *elem)
+{
+  if (elem->prev)
+    elem->prev->next = elem->next;
+  else
+    *oldest = elem->next;
+  if (elem->next)
+    elem->next->prev = elem->prev;
+  else
+    *newest = elem->prev;
+}
+
+// ================= Slab allocator of elements =================
+// Elements are allocated by slabs and recycled, without using the heap.
+// Workers keep free elements in a local cache, exchanged by batches with a shared free list.
+
+// Moves free elements from the local cache of a worker to the shared free list, until 'keep' are left. Called with threadpool->slab.mutex locked.
+static void
+threadpool_worker_cache_flush (struct threadpool *threadpool, struct worker *worker, size_t keep)
+{
+  while (worker->nb_free_elems > keep)
   {
-    struct timespec timeout = delay_to_abs_timespec (threadpool->idle_timeout); // from timers.h
-    threadpool->nb_idle_workers++;
-    while (!threadpool_something_to_process_predicate (threadpool) && !threadpool_is_done_predicate (threadpool))       // Predicate is not fulfilled: wait in idle state.
-    {
-      threadpool_monitor_call (threadpool, 0);
-      int cnd;
-      if (threadpool->nb_async_tasks)
-        thrd_honored (cnd_wait (&threadpool->proceed_or_conclude_or_runoff, &threadpool->mutex));       // Wait for continuators to be processed (threadpool_task_continue) or to timeout (threadpool_task_continuation_timeout_handler).
-      else if ((cnd = cnd_timedwait (&threadpool->proceed_or_conclude_or_runoff, &threadpool->mutex, &timeout)) == thrd_timedout)       // Wait for condition to be signalled or until after the TIME_UTC-based calendar time pointed to by &timeout
-        break;                  // Timeout: time to end the worker.
-      else
-        thrd_honored (cnd);
-    }                           // while (!threadpool_something_to_process_predicate (threadpool) && !threadpool_is_done_predicate (threadpool))
-    assert (threadpool->nb_idle_workers--);
-    if (threadpool_something_to_process_predicate (threadpool)) // First condition of the predicate is true (both conditions can't be true at the same time by design.)
+    struct elem *elem = worker->free_elems;
+    worker->free_elems = elem->next;
+    worker->nb_free_elems--;
+    elem->next = threadpool->slab.free_elems;
+    threadpool->slab.free_elems = elem;
+  }
+}
+
+static struct elem *
+threadpool_elem_alloc (struct threadpool *threadpool)
+{
+  struct worker *worker = Worker_context.worker;
+  if (worker && worker->threadpool != threadpool)
+    worker = 0;                 // Not a worker of this thread pool: the shared free list is used.
+  struct elem *elem;
+  if (worker && (elem = worker->free_elems))
+  {
+    worker->free_elems = elem->next;
+    worker->nb_free_elems--;
+    return elem;
+  }
+  thrd_honored (mtx_lock (&threadpool->slab.mutex));
+  if (!threadpool->slab.free_elems)
+  {
+    struct slab *slab = malloc (sizeof (*slab) + SLAB_NB_ELEMS * sizeof (*slab->elem));
+    if (!slab)
     {
-      struct elem *old_elem = threadpool->out;
-      if (threadpool->in == threadpool->out)
-        threadpool->in = threadpool->out = 0;   // The first condition of predicate becomes false: no need to signal it.
-      else
-        threadpool->out = threadpool->out->next;        // The first condition of the predicate remains true: no need to signal it.
-      tp_result_t ret = TP_JOB_CANCELED;
-      if (old_elem->task.work)
-      {
-        assert (threadpool->nb_pending_tasks--);
-        threadpool->nb_processing_tasks++;      // The extracted data has to be processed somewhere.
-        threadpool_monitor_call (threadpool, 0);        // Processing worker
-        Worker_context.current_task = &old_elem->task;  // Used if 'threadpool_task_continuation' is called in a task.
-        thrd_honored (mtx_unlock (&threadpool->mutex)); // Unlock
-        ret = old_elem->task.work (old_elem->task.job.data);    //<<<<<<<<<< work <<<<<<<<<<< (N.B.: work could itself add tasks by calling 'threadpool_add_task').
-        thrd_honored (mtx_lock (&threadpool->mutex));   // Relock
-        if (ret != TP_JOB_SUCCESS)
-          old_elem->task.to_be_continued = 0;   // We won't consider the continuation
-        Worker_context.current_task = 0;
-        assert (threadpool->nb_processing_tasks--);
-      }                         // if (old_elem->task.work)
-      // Update ret with the result of the job deletor (which can hold aggregation)
-      if (!old_elem->task.to_be_continued && old_elem->task.job.data_delete)    // Call to task.job.data_delete is MT-safe (guarded by threadpool->mutex)
-        ret = old_elem->task.job.data_delete (old_elem->task.job.data, ret);    // Note (*): get rid of job after use (and if it is not scheduled in a continuation).
-      if (old_elem->task.work && !old_elem->task.to_be_continued)       // For a continuation task, we have to wait for the continuation before we know the final result.
-      {
-        if (ret == TP_JOB_FAILURE)
-          threadpool->nb_failed_tasks++;
-        else if (ret == TP_JOB_SUCCESS)
-          threadpool->nb_succeeded_tasks++;
-        else if (ret == TP_JOB_CANCELED)
-          threadpool->nb_canceled_tasks++;
-        if ((threadpool->property == TP_RUN_ALL_SUCCESSFUL_TASKS && ret == TP_JOB_FAILURE) || (threadpool->property == TP_RUN_ONE_SUCCESSFUL_TASK && ret == TP_JOB_SUCCESS))
-          threadpool_cancel_task (threadpool, TP_CANCEL_ALL_PENDING_TASKS);     // Cancel automatically other already submitted tasks (threadpool->mutex is mtx_recursive)
-      }
-      if (old_elem->task.work)
-        threadpool_monitor_call (threadpool, 0);
-      free (old_elem);
-      continue;                 // while (1) 
-    }                           // if (threadpool_something_to_process_predicate (threadpool))
-    else if (threadpool_is_done_predicate (threadpool)) // Second condition of the predicate is true: 
-      thrd_honored (cnd_broadcast (&threadpool->proceed_or_conclude_or_runoff));        // broadcast it to unblock and finish all pending threads.
-    break;                      // Work is done or the predicate was not fulfilled due to timeout. Quit.
-  }                             // while (1)
-  void *localdata = Worker_context.local_data;
-  Worker_context.local_data = 0;
-  if (threadpool->worker_local_data_manager.destroy)
-    threadpool->worker_local_data_manager.destroy (localdata);
-  for (size_t i = 0; i < threadpool->requested_nb_workers; i++)
-    if (threadpool->active_worker_id[i] && thrd_equal (thrd_current (), *threadpool->active_worker_id[i]))
+      thrd_honored (mtx_unlock (&threadpool->slab.mutex));
+      return 0;
+    }
+    slab->next = threadpool->slab.slabs;
+    threadpool->slab.slabs = slab;
+    threadpool->slab.nb_bytes += sizeof (*slab) + SLAB_NB_ELEMS * sizeof (*slab->elem);
+    for (size_t i = 0; i < SLAB_NB_ELEMS; i++)
     {
-      threadpool->active_worker_id[i] = 0;      // Unregister active worker.
-      assert (threadpool->nb_alive_workers--);
-      threadpool_monitor_call (threadpool, 0);
-      if (threadpool->nb_alive_workers == 0 && threadpool->resource.deallocator)
-      {
-        threadpool->resource.deallocator (threadpool->resource.data);
-        threadpool->resource.data = 0;
-        threadpool_monitor_call (threadpool, 0);
-      }
-      if (threadpool_runoff_predicate (threadpool))     // The last worker is quitting:
-        thrd_honored (cnd_signal (&threadpool->proceed_or_conclude_or_runoff)); //  signals it.
-      break;
+      slab->elem[i].next = threadpool->slab.free_elems;
+      threadpool->slab.free_elems = &slab->elem[i];
     }
-  Worker_context.threadpool = 0;
-  thrd_honored (mtx_unlock (&threadpool->mutex));
-  return 1;
+  }
+  elem = threadpool->slab.free_elems;
+  threadpool->slab.free_elems = elem->next;
+  for (struct elem * e; worker && worker->nb_free_elems < WORKER_CACHE_NB_ELEMS && (e = threadpool->slab.free_elems); worker->nb_free_elems++)
+  {
+    threadpool->slab.free_elems = e->next;      // Refill the local cache.
+    e->next = worker->free_elems;
+    worker->free_elems = e;
+  }
+  thrd_honored (mtx_unlock (&threadpool->slab.mutex));
+  return elem;
 }
 
-static size_t
-threadpool_create_task (struct threadpool *threadpool, tp_result_t (*work) (void *job), void *job, tp_result_t (*job_delete) (void *job, tp_result_t result), int is_continuation)
+static void
+threadpool_elem_free (struct threadpool *threadpool, struct elem *elem)
 {
-  struct elem *new_elem = malloc (sizeof (*new_elem));
-  if (!new_elem)
+  struct worker *worker = Worker_context.worker;
+  if (worker && worker->threadpool == threadpool)
   {
-    fprintf (stderr, "%s: %s\n", __func__, _("Out of memory."));
-    errno = ENOMEM;
-    return 0;
+    elem->next = worker->free_elems;
+    worker->free_elems = elem;
+    if (++worker->nb_free_elems < 2 * WORKER_CACHE_NB_ELEMS)
+      return;
+    thrd_honored (mtx_lock (&threadpool->slab.mutex));
+    threadpool_worker_cache_flush (threadpool, worker, WORKER_CACHE_NB_ELEMS);  // The local cache is full.
   }
-  thrd_honored (mtx_lock (&threadpool->mutex));
-  if (!is_continuation)
-    if ((threadpool->property == TP_RUN_ONE_SUCCESSFUL_TASK && threadpool->nb_succeeded_tasks)
-        || (threadpool->property == TP_RUN_ALL_SUCCESSFUL_TASKS && threadpool->nb_failed_tasks))
-      work = 0;                 // Cancel automatically new submitted tasks.
-
-  struct task task = {.job.data = job,.work = work,.job.data_delete = job_delete,.to_be_continued = 0,.is_continuation = is_continuation };
-  new_elem->task = task;
-  new_elem->next = 0;
-  if (!threadpool->in)
-    threadpool->in = threadpool->out = new_elem;
   else
   {
-    threadpool->in->next = new_elem;
-    threadpool->in = new_elem;
+    thrd_honored (mtx_lock (&threadpool->slab.mutex));
+    elem->next = threadpool->slab.free_elems;
+    threadpool->slab.free_elems = elem;
   }
-  if (++threadpool->nb_created_tasks == TP_CANCEL_ALL_PENDING_TASKS)
-    threadpool->nb_created_tasks = 1;   // Overflow. Wrap around.
-  size_t id = new_elem->task.id = threadpool->nb_created_tasks; // task.id starts from 1.
-  if (!is_continuation)         // A continuation need not be counted again.
-    threadpool->nb_submitted_tasks++;
-  if (work)
-    threadpool->nb_pending_tasks++;
-  else
-    threadpool->nb_canceled_tasks++;
-  if (threadpool->nb_idle_workers)      // A job has been added to the thread pool of workers and at least one worker is idle and available:
-    thrd_honored (cnd_signal (&threadpool->proceed_or_conclude_or_runoff));     // Signal it to wake up one of the idle workers.
-  else if (threadpool->nb_alive_workers < threadpool->requested_nb_workers)     // No workers are idle and available to process this new task at once:
-    for (size_t i = 0; i < threadpool->requested_nb_workers; i++)       // Search for a non-running worker and start it.
-      if (!threadpool->active_worker_id[i] && thrd_create (&threadpool->worker_id[i], thread_worker_runner, threadpool) == thrd_success)        // Create a new worker.
-      {
-        threadpool->active_worker_id[i] = &threadpool->worker_id[i];    // Register active worker.
-        // Note: a new worker thread has been created by thrd_create, but thread_worker_runner might not be launched right away.
-        // Anyway, the worker has to be taken into consideration by the predicate threadpool_runoff_predicate with threadpool->nb_alive_workers++ to
-        // let the thread pool know a new worker in on its way. This can not be deferred at the beginning of thread_worker_runner.
-        if (threadpool->nb_alive_workers == 0 && threadpool->resource.allocator && !threadpool->resource.data)
-        {
-          threadpool_monitor_call (threadpool, 0);
-          threadpool->resource.data = threadpool->resource.allocator (threadpool->global_data);
-        }
-        threadpool->nb_alive_workers++;
-        if (threadpool->max_nb_workers < threadpool->nb_alive_workers)
-          threadpool->max_nb_workers = threadpool->nb_alive_workers;
+  thrd_honored (mtx_unlock (&threadpool->slab.mutex));
+}
+
+// ================= Queues =================
+// Submission ring (D. Vyukov, bounded MPMC queue, https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue).
+// Returns 0 if the ring is full.
+static int
+threadpool_ring_push (struct threadpool *threadpool, struct elem *elem)
+{
+  size_t pos = threadpool->ring.enqueue_pos;
+  struct cell *cell;
+  while (1)
+  {
+    cell = &threadpool->ring.cell[pos & threadpool->ring.mask];
+    size_t sequence = cell->sequence;
+    if (sequence == pos)        // The cell is free: try to book it.
+    {
+      if (atomic_compare_exchange_weak (&threadpool->ring.enqueue_pos, &pos, pos + 1))
         break;
-      }
-  threadpool_monitor_call (threadpool, 0);
-  thrd_honored (mtx_unlock (&threadpool->mutex));
-  return id;
+    }
+    else if ((intptr_t) (sequence - pos) < 0)   // The cell is still filled, one lap behind: the ring is full.
+      return 0;
+    else                        // The cell was booked by another producer.
+      pos = threadpool->ring.enqueue_pos;
+  }
+  cell->elem = elem;
+  cell->sequence = pos + 1;     // Publish.
+  return 1;
 }
 
-size_t
-threadpool_add_task (struct threadpool *threadpool, tp_result_t (*work) (void *job), void *job, tp_result_t (*job_delete) (void *job, tp_result_t result))
+// Called with threadpool->mutex locked (consumers are serialised).
+static struct elem *
+threadpool_ring_pop (struct threadpool *threadpool)
 {
-  return threadpool_create_task (threadpool, work, job, job_delete, 0);
+  if (!threadpool_ring_is_filled (threadpool))
+    return 0;
+  struct cell *cell = &threadpool->ring.cell[threadpool->ring.dequeue_pos & threadpool->ring.mask];
+  struct elem *elem = cell->elem;
+  cell->sequence = threadpool->ring.dequeue_pos + threadpool->ring.mask + 1;    // Free the cell for the next lap.
+  threadpool->ring.dequeue_pos++;
+  return elem;
 }
 
-void
-threadpool_wait_and_destroy (struct threadpool *threadpool)
+// ================= Index of queued elements =================
+// The elements of the queues guarded by threadpool->mutex (FIFOs, deadlines and blocked tasks) are indexed by task id, in a hash table with chaining,
+// so that a task can be found and unlinked from its queue without scanning (see threadpool_cancel_task).
+// Task ids are allocated sequentially: their lowest bits spread the elements evenly over the buckets.
+
+// Doubles the number of buckets. The index is kept as is if memory is short (lookups are only slower). Called with threadpool->mutex locked.
+static void
+threadpool_index_grow (struct threadpool *threadpool)
 {
-  thrd_honored (mtx_lock (&threadpool->mutex));
-  threadpool_monitor_call (threadpool, 1);
-  threadpool->concluding = 1;   // Declares that no more tasks will be added into the FIFO by the caller of 'threadpool_wait_and_destroy' (processing workers can still add tasks).
-  // The predicate is modified to true (concluding set to 1):
-  if (threadpool_is_done_predicate (threadpool))        // No running tasks (asynchronous or not)
-    thrd_honored (cnd_broadcast (&threadpool->proceed_or_conclude_or_runoff));  // broadcast it to unblock and finish all pending threads.
-  while (!threadpool_runoff_predicate (threadpool))     // Wait for all tasks (either virtual or not) to be processed and all running workers to terminate properly.
-    thrd_honored (cnd_wait (&threadpool->proceed_or_conclude_or_runoff, &threadpool->mutex));
-  threadpool_monitor_call (threadpool, 1);
-  if (threadpool->monitor.processor)
-    threadpool_wait_and_destroy (threadpool->monitor.processor);        // Barrier to wait for all monitoring processes to finish.
-  thrd_honored (mtx_unlock (&threadpool->mutex));
+  size_t nb_buckets = 2 * (threadpool->index.mask + 1);
+  struct elem **bucket = calloc (nb_buckets, sizeof (*bucket));
+  if (!bucket)
+    return;
+  for (size_t i = 0; i <= threadpool->index.mask; i++)
+    for (struct elem * elem = threadpool->index.bucket[i], *next; elem; elem = next)
+    {
+      next = elem->index_next;
+      elem->index_next = bucket[elem->task.id & (nb_buckets - 1)];
+      bucket[elem->task.id & (nb_buckets - 1)] = elem;
+    }
+  free (threadpool->index.bucket);
+  threadpool->index.bucket = bucket;
+  threadpool->index.mask = nb_buckets - 1;
+}
 
-  free (threadpool->worker_id);
-  free (threadpool->active_worker_id);
-  mtx_destroy (&threadpool->mutex);
-  cnd_destroy (&threadpool->proceed_or_conclude_or_runoff);
-  free (threadpool);
+// Called with threadpool->mutex locked.
+static void
+threadpool_index_insert (struct threadpool *threadpool, struct queue *queue, struct elem *elem)
+{
+  if (threadpool->index.nb_elems > threadpool->index.mask)      // Load factor above 1.
+    threadpool_index_grow (threadpool);
+  struct elem **bucket = &threadpool->index.bucket[elem->task.id & threadpool->index.mask];
+  elem->index_next = *bucket;
+  *bucket = elem;
+  elem->queue = queue;
+  threadpool->index.nb_elems++;
 }
 
-void *
-threadpool_worker_local_data (void)
+// Called with threadpool->mutex locked.
+static void
+threadpool_index_remove (struct threadpool *threadpool, struct elem *elem)
 {
-  return Worker_context.local_data;
+  struct elem **e = &threadpool->index.bucket[elem->task.id & threadpool->index.mask];
+  while (*e != elem)
+    e = &(*e)->index_next;
+  *e = elem->index_next;
+  elem->queue = 0;
+  threadpool->index.nb_elems--;
 }
 
-void *
-threadpool_global_data (void)
+// Returns the pending (not canceled) element of task 'id', if indexed. Called with threadpool->mutex locked.
+static struct elem *
+threadpool_index_find (struct threadpool *threadpool, size_t id)
 {
-  if (Worker_context.threadpool)
-    return Worker_context.threadpool->global_data;
-  else
-    return 0;
+  struct elem *elem = threadpool->index.bucket[id & threadpool->index.mask];
+  while (elem && (elem->task.id != id || !elem->task.work))
+    elem = elem->index_next;
+  return elem;
 }
 
-size_t
-threadpool_cancel_task (struct threadpool *threadpool, size_t task_id)
+// Queues an element in an indexed queue (a FIFO or the blocked tasks). Called with threadpool->mutex locked.
+static void
+threadpool_queue_push (struct threadpool *threadpool, struct queue *queue, struct elem *elem)
 {
-  size_t ret = 0;
-  thrd_honored (mtx_lock (&threadpool->mutex));
-  if (task_id == TP_CANCEL_LAST_PENDING_TASK)
+  elem_push (&queue->in, &queue->out, elem);
+  queue->nb_elems++;
+  threadpool_index_insert (threadpool, queue, elem);
+  if (queue != &threadpool->blocked)    // Blocked tasks are not ready to be processed.
+    threadpool->nb_queued_elems++;
+}
+
+// Unlinks an element from the indexed queue it is linked in, wherever in the queue. Called with threadpool->mutex locked.
+static void
+threadpool_queue_unlink (struct threadpool *threadpool, struct elem *elem)
+{
+  struct queue *queue = elem->queue;
+  elem_unlink (&queue->in, &queue->out, elem);
+  queue->nb_elems--;
+  threadpool_index_remove (threadpool, elem);
+  if (queue != &threadpool->blocked)
+    threadpool->nb_queued_elems--;
+}
+
+// Called with threadpool->mutex locked.
+static void
+threadpool_fifo_push (struct threadpool *threadpool, size_t level, struct elem *elem)
+{
+  if (threadpool->priority_aging > 0. && level < TP_NB_PRIORITY_LEVELS - 1)
+    timespec_get (&elem->time, TIME_UTC);
+  threadpool_queue_push (threadpool, &threadpool->fifo[level], elem);
+}
+
+// Called with threadpool->mutex locked.
+static struct elem *
+threadpool_fifo_pop (struct threadpool *threadpool, size_t level)
+{
+  struct elem *elem = threadpool->fifo[level].out;
+  if (elem)
+    threadpool_queue_unlink (threadpool, elem);
+  return elem;
+}
+
+// Inserts an element after the elements of the queue with an earlier or equal time (elem->time), without indexing it.
+static void
+elem_insert_by_time (struct queue *queue, struct elem *elem)
+{
+  struct elem *prev = queue->in;
+  while (prev && elapsed_seconds (&elem->time, &prev->time) > 0.)       // Searched from the latest time, as times are usually increasing.
+    prev = prev->prev;
+  if (prev == queue->in)
+    elem_push (&queue->in, &queue->out, elem);
+  else
   {
-    struct elem *last = 0;
-    for (struct elem * e = threadpool->out; e; e = e->next)
-      if (e->task.work)
-        last = e;
-    if (last)
-    {
-      last->task.work = 0;      // The job won't be processed by thread_worker_runner.
-      ret++;
-    }
+    struct elem *next = prev ? prev->next : queue->out;
+    elem->prev = prev;
+    elem->next = next;
+    next->prev = elem;
+    if (prev)
+      prev->next = elem;
+    else
+      queue->out = elem;
   }
-  else
-    for (struct elem * e = threadpool->out; e; e = e->next)
-    {
-      if (!((task_id == TP_CANCEL_NEXT_PENDING_TASK && e->task.work) || e->task.id == task_id || task_id == TP_CANCEL_ALL_PENDING_TASKS))
-        continue;
-      if (e->task.work)
-        ret++;
-      e->task.work = 0;         // The job won't be processed by thread_worker_runner.
-      if (task_id == TP_CANCEL_NEXT_PENDING_TASK || e->task.id == task_id)
-        break;
-    }
-  // Monitor immediately (without waiting for the task to be processed).
-  assert (threadpool->nb_pending_tasks >= ret);
-  threadpool->nb_pending_tasks -= ret;
-  threadpool->nb_canceled_tasks += ret;
-  thrd_honored (mtx_unlock (&threadpool->mutex));
-  return ret;
+  queue->nb_elems++;
 }
 
-void
-threadpool_set_idle_timeout (struct threadpool *threadpool, double delay)
+// Inserts an element with a deadline (set in elem->time) after the elements with an earlier or equal deadline. Called with threadpool->mutex locked.
+static void
+threadpool_deadline_push (struct threadpool *threadpool, struct elem *elem)
 {
-  static double inifinity = 120 * 24 * 3600 /* seconds */ ;     // 120 UTC days.
-  if (delay > inifinity)
-    delay = inifinity;
-  if (delay >= 0.)
+  elem_insert_by_time (&threadpool->deadlines, elem);
+  threadpool_index_insert (threadpool, &threadpool->deadlines, elem);
+  threadpool->nb_queued_elems++;
+}
+
+// Decrements the number of pending tasks by 'nb', and lets a producer waiting for room (TP_BACKPRESSURE_BLOCK) submit again once it drops below the bound:
+// one producer is woken up per decrement, all of them when no task is pending anymore. Called with threadpool->mutex locked.
+static void
+threadpool_pending_tasks_done (struct threadpool *threadpool, size_t nb)
+{
+  assert (threadpool->nb_pending_tasks >= nb);
+  threadpool->nb_pending_tasks -= nb;
+  if (nb && threadpool->backpressure.nb_waiters && threadpool->nb_pending_tasks < threadpool->backpressure.max_pending)
+    thrd_honored (threadpool->nb_pending_tasks ? cnd_signal (&threadpool->backpressure.not_full) : cnd_broadcast (&threadpool->backpressure.not_full));
+}
+
+// Pops the element with the earliest deadline. The task is canceled if its deadline has passed. Called with threadpool->mutex locked.
+static struct elem *
+threadpool_deadline_pop (struct threadpool *threadpool)
+{
+  struct elem *elem = threadpool->deadlines.out;
+  if (!elem)
+    return 0;
+  threadpool_queue_unlink (threadpool, elem);
+  struct timespec now;
+  timespec_get (&now, TIME_UTC);
+  if (elem->task.work && elapsed_seconds (&elem->time, &now) > 0.)      // Expired: the job won't be processed by thread_worker_runner.
   {
-    thrd_honored (mtx_lock (&threadpool->mutex));
-    threadpool->idle_timeout = delay;
-    thrd_honored (mtx_unlock (&threadpool->mutex));
+    elem->task.work = 0;
+    threadpool_pending_tasks_done (threadpool, 1);
+    threadpool->nb_canceled_tasks++;
+    threadpool->nb_expired_tasks++;
   }
-  else
-    errno = EINVAL;
+  return elem;
+}
+
+// Anti-starvation: moves the tasks which have been waiting for longer than threadpool->priority_aging up to the next priority level.
+// Called with threadpool->mutex locked.
+static void
+threadpool_age_priorities (struct threadpool *threadpool)
+{
+  struct timespec now;
+  timespec_get (&now, TIME_UTC);
+  for (size_t level = TP_NB_PRIORITY_LEVELS - 1; level-- > 0;)  // Tasks are moved up by one level at most.
+    for (struct elem * elem; (elem = threadpool->fifo[level].out)
+         && elapsed_seconds (&elem->time, &now) >= threadpool->priority_aging;)
+      threadpool_fifo_push (threadpool, level + 1, threadpool_fifo_pop (threadpool, level));
+}
+
+// ================= Fibers =================
+// With fibers (see threadpool_set_fibers), each task runs on its own user-mode context (a fiber, with its own stack), multiplexed over the threads of the workers.
+// A task which sleeps or yields (threadpool_task_sleep, threadpool_task_yield) switches back to the worker which resumed it, without holding its thread:
+// it is unlinked from the running tasks and counted as an asynchronous task while suspended, and any worker can resume it later.
+// A fiber is only switched out with threadpool->mutex unlocked, and is queued to be resumed by the worker it switched back to, once its context is saved.
+#ifdef __GLIBC__
+enum
+{ FIBER_RUNNING, FIBER_SLEEPING, FIBER_YIELDED, FIBER_DONE };
+
+struct fiber
+{
+  ucontext_t context;           // Context of the task, saved while suspended.
+  ucontext_t *caller;           // Context of the worker which resumed the task, saved while the task runs.
+  int state;
+  tp_result_t ret;              // Result of the work of the task, once done.
+  struct timespec wake_up;      // Time until which the task sleeps.
+  struct fiber *next;           // Next free fiber.
+  size_t stack_size;            // Size of the stack, as allocated.
+  max_align_t stack[];
+};
+
+static void
+threadpool_fiber_entry (void)
+{
+  struct task *task = Worker_context.current_task;      // Set by the worker which starts the task, and not read after the work returns (thread local).
+  task->fiber->ret = task->work (task->job.data);       //<<<<<<<<<< work, on the fiber <<<<<<<<<<<
+  task->fiber->state = FIBER_DONE;
+  setcontext (task->fiber->caller);     // Back to the worker which resumed the task last.
+}
+
+// Makes the context of a fiber start threadpool_fiber_entry on its own stack.
+static void
+threadpool_fiber_make (struct fiber *fiber, size_t stack_size)
+{
+  thrd_honored (getcontext (&fiber->context) ? thrd_error : thrd_success);
+  fiber->context.uc_stack.ss_sp = fiber->stack;
+  fiber->context.uc_stack.ss_size = stack_size;
+  fiber->context.uc_link = 0;
+  makecontext (&fiber->context, threadpool_fiber_entry, 0);
+  fiber->state = FIBER_RUNNING;
+}
+
+// Returns a fiber ready to run the task being processed by the worker, or 0 if out of memory. Called with threadpool->mutex locked.
+static struct fiber *
+threadpool_fiber_alloc (struct threadpool *threadpool)
+{
+  struct fiber *fiber = threadpool->fibers.free;
+  if (fiber)
+  {
+    threadpool->fibers.free = fiber->next;
+    threadpool->fibers.nb_free--;
+  }
+  else if ((fiber = malloc (sizeof (*fiber) + threadpool->fibers.stack_size)))
+    fiber->stack_size = threadpool->fibers.stack_size;
+  else
+    return 0;
+  threadpool_fiber_make (fiber, fiber->stack_size);
+  return fiber;
+}
+
+// Keeps a fiber for reuse, at most one per worker slot, unless its stack size is not the current one (see threadpool_set_fibers).
+// Called with threadpool->mutex locked.
+static void
+threadpool_fiber_free (struct threadpool *threadpool, struct fiber *fiber)
+{
+  if (threadpool->fibers.nb_free >= threadpool->requested_nb_workers || fiber->stack_size != threadpool->fibers.stack_size)
+  {
+    free (fiber);
+    return;
+  }
+  fiber->next = threadpool->fibers.free;
+  threadpool->fibers.free = fiber;
+  threadpool->fibers.nb_free++;
+}
+
+// Starts or resumes the task on its fiber until it is done (then returns the result of its work) or suspended. Called with threadpool->mutex unlocked.
+static tp_result_t
+threadpool_fiber_run (struct fiber *fiber)
+{
+  ucontext_t caller;
+  fiber->caller = &caller;
+  fiber->state = FIBER_RUNNING;
+  thrd_honored (swapcontext (&caller, &fiber->context) ? thrd_error : thrd_success);
+  return fiber->ret;
+}
+
+// Suspends the task running on 'fiber', back to the worker which resumed it. Returns once the task is resumed, possibly by another worker.
+static void
+threadpool_fiber_switch (struct fiber *fiber, int state)
+{
+  fiber->state = state;
+  thrd_honored (swapcontext (&fiber->context, fiber->caller) ? thrd_error : thrd_success);
+}
+
+// Queues a suspended task to be resumed, now or when it wakes up. Called with threadpool->mutex locked.
+static void
+threadpool_fiber_suspend (struct threadpool *threadpool, struct elem *elem)
+{
+  if (elem->task.fiber->state == FIBER_SLEEPING)
+  {
+    elem->time = elem->task.fiber->wake_up;
+    elem_insert_by_time (&threadpool->fibers.sleeping, elem);
+    if (threadpool->fibers.sleeping.out == elem)        // Parked workers wait for the previous earliest wake-up time.
+      threadpool_wake_up_parked_workers (threadpool, 1);
+  }
+  else                          // Yielded.
+  {
+    elem_push (&threadpool->fibers.resumed.in, &threadpool->fibers.resumed.out, elem);
+    threadpool->fibers.resumed.nb_elems++;
+    threadpool->nb_queued_elems++;
+  }
+}
+#endif
+
+// Moves the sleeping tasks whose wake-up time has passed to the resumed tasks, and wakes up parked workers to resume them.
+// Called with threadpool->mutex locked.
+static void
+threadpool_fiber_wake_up (struct threadpool *threadpool)
+{
+  struct timespec now;
+  timespec_get (&now, TIME_UTC);
+  size_t nb = 0;
+  for (struct elem * elem; (elem = threadpool->fibers.sleeping.out) && elapsed_seconds (&elem->time, &now) >= 0.; nb++)
+  {
+    elem_pop_oldest (&threadpool->fibers.sleeping.in, &threadpool->fibers.sleeping.out);
+    threadpool->fibers.sleeping.nb_elems--;
+    elem_push (&threadpool->fibers.resumed.in, &threadpool->fibers.resumed.out, elem);
+    threadpool->fibers.resumed.nb_elems++;
+    threadpool->nb_queued_elems++;
+  }
+  if (nb > 1)
+    threadpool_wake_up_parked_workers (threadpool, nb - 1);     // The calling worker resumes one.
+}
+
+// Returns the next element to be processed by the calling worker, or 0 if another worker was faster.
+// Called with threadpool->mutex locked.
+static struct elem *
+threadpool_next_elem (struct threadpool *threadpool)
+{
+  struct elem *elem = 0;
+  if (threadpool->canceled.nb_elems)    // First, get rid of the canceled elements, all at once.
+    threadpool_complete_canceled (threadpool);
+  if (threadpool->priority_aging > 0.)
+    threadpool_age_priorities (threadpool);
+  if (threadpool->fibers.sleeping.nb_elems)
+    threadpool_fiber_wake_up (threadpool);
+  if (threadpool->deadlines.nb_elems && (elem = threadpool_deadline_pop (threadpool)))  // First, tasks with a deadline, earliest deadline first, whatever the priority of the others.
+    return elem;
+  for (size_t level = TP_NB_PRIORITY_LEVELS - 1; level > 0; level--)    // Then, the FIFOs of prioritised tasks, highest priority first.
+    if (threadpool->fifo[level].nb_elems && (elem = threadpool_fifo_pop (threadpool, level)))
+      return elem;
+  if (threadpool->fibers.resumed.nb_elems)      // Then, suspended tasks to be resumed, as started tasks are completed before new ones are started.
+  {
+    elem = elem_pop_oldest (&threadpool->fibers.resumed.in, &threadpool->fibers.resumed.out);
+    threadpool->fibers.resumed.nb_elems--;
+    threadpool->nb_queued_elems--;
+    return elem;
+  }
+  struct worker *self = Worker_context.worker;
+  if (self->nb_elems)           // Then, the most recently pushed task of the local deque (LIFO, hot in cache).
+  {
+    thrd_honored (mtx_lock (&self->mutex));
+    if ((elem = elem_pop_newest (&self->top, &self->bottom)))
+    {
+      self->nb_elems--;
+      threadpool->nb_queued_elems--;
+    }
+    thrd_honored (mtx_unlock (&self->mutex));
+    if (elem)
+      return elem;
+  }
+  if ((elem = threadpool_ring_pop (threadpool)))        // Then, the submission ring and the FIFO of externally submitted tasks.
+    return elem;
+  if ((elem = threadpool_fifo_pop (threadpool, 0)))
+    return elem;
+  // Last, steal the least recently pushed task from the local deque of another worker (FIFO), starting from the next slot.
+  // Workers on the same NUMA node are preferred (first pass).
+  size_t self_no = (size_t) (self - threadpool->worker);
+  int same_node_first = threadpool->nb_numa_nodes > 1;
+  for (int pass = !same_node_first; pass < 2; pass++)
+    for (size_t i = 1; i < threadpool->nb_used_slots && threadpool->nb_queued_elems; i++)
+    {
+      struct worker *victim = &threadpool->worker[(self_no + i) % threadpool->nb_used_slots];
+      if (!victim->nb_elems || (same_node_first && (victim->node == self->node) == pass))
+        continue;
+      thrd_honored (mtx_lock (&victim->mutex));
+      if ((elem = elem_pop_oldest (&victim->top, &victim->bottom)))
+      {
+        victim->nb_elems--;
+        threadpool->nb_queued_elems--;
+      }
+      thrd_honored (mtx_unlock (&victim->mutex));
+      if (elem)
+        return elem;
+    }
+  return 0;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define cpu_relax() __builtin_ia32_pause ()
+#elif defined(__GNUC__) && defined(__aarch64__)
+#  define cpu_relax() __asm__ __volatile__ ("yield")
+#else
+#  define cpu_relax() do {} while (0)
+#endif
+
+// Polls for new tasks, without locking, for at most threadpool->idle_spin seconds, before an idle worker parks.
+// Tasks arriving in bursts are then taken without a wake-up through the scheduler.
+// Called with threadpool->mutex locked, which is released while polling.
+static void
+threadpool_idle_spin (struct threadpool *threadpool)
+{
+  double spin = threadpool->idle_spin;
+  size_t enqueue_pos = threadpool->ring.cell ? threadpool->ring.enqueue_pos : 0;
+  struct timespec t0, t;
+  timespec_get (&t0, TIME_UTC);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  for (unsigned int i = 1; !threadpool->nb_queued_elems && !(threadpool->ring.cell && threadpool->ring.enqueue_pos != enqueue_pos); i++)
+    if (i % 64)
+      cpu_relax ();
+    else                        // From time to time, let other threads run (the submitter could share the CPU) and check the delay.
+    {
+      thrd_yield ();
+      timespec_get (&t, TIME_UTC);
+      if (elapsed_seconds (&t0, &t) >= spin)
+        break;
+    }
+  thrd_honored (mtx_lock (&threadpool->mutex));
+}
+
+// ================= Parking of idle workers =================
+// Each idle worker waits on its own condition variable, so that exactly as many workers as needed are woken up.
+// Called with threadpool->mutex locked.
+static void
+threadpool_worker_unpark (struct threadpool *threadpool, struct worker *worker)
+{
+  if (worker->parked_prev)
+    worker->parked_prev->parked_next = worker->parked_next;
+  else
+    threadpool->parked = worker->parked_next;
+  if (worker->parked_next)
+    worker->parked_next->parked_prev = worker->parked_prev;
+  worker->parked = 0;
+}
+
+// Waits until the worker is woken up, or until 'timeout' if not null. Called with threadpool->mutex locked.
+static int
+threadpool_worker_park (struct threadpool *threadpool, struct worker *worker, const struct timespec *timeout)
+{
+  if (!worker->parked)
+  {
+    worker->parked = 1;
+    worker->parked_prev = 0;
+    if ((worker->parked_next = threadpool->parked))
+      threadpool->parked->parked_prev = worker;
+    threadpool->parked = worker;
+  }
+  int ret = timeout ? cnd_timedwait (&worker->wake_up, &threadpool->mutex, timeout) : cnd_wait (&worker->wake_up, &threadpool->mutex);
+  if (worker->parked && ret != thrd_success)
+    threadpool_worker_unpark (threadpool, worker);
+  return ret;
+}
+
+// Wakes up at most 'nb' parked workers, the most recently parked first (hot in cache). Returns the number of woken up workers.
+// Called with threadpool->mutex locked.
+static size_t
+threadpool_wake_up_parked_workers (struct threadpool *threadpool, size_t nb)
+{
+  size_t ret = 0;
+  for (struct worker * worker; ret < nb && (worker = threadpool->parked); ret++)
+  {
+    threadpool_worker_unpark (threadpool, worker);
+    thrd_honored (cnd_signal (&worker->wake_up));
+  }
+  return ret;
+}
+
+// Takes into account the result of a completed predecessor of a blocked task.
+static void
+threadpool_task_predecessor_done (struct threadpool *threadpool, struct task *task, tp_result_t result)
+{
+  if (result == TP_JOB_CANCELED || (threadpool->property == TP_RUN_ALL_SUCCESSFUL_TASKS && result == TP_JOB_FAILURE))
+    task->predecessor_failed = 1;       // Cancellation (or failure) is propagated to the successors.
+}
+
+// Records the result of a completed task, queues the successors it was the last predecessor of, and wakes up the threads waiting for it.
+// Called with threadpool->mutex locked, by the thread which completed the task: a worker of the thread pool,
+// or a producer which processed the task inline (TP_BACKPRESSURE_RUN_INLINE).
+static void
+threadpool_future_complete (struct threadpool *threadpool, struct future *future, tp_result_t result)
+{
+  future->result = result;
+  future->done = 1;
+  struct worker *worker = Worker_context.worker && Worker_context.worker->threadpool == threadpool ? Worker_context.worker : 0;
+  size_t nb_released = 0;
+  for (struct successor * successor; (successor = future->successors); free (successor))
+  {
+    future->successors = successor->next;
+    struct elem *elem = successor->elem;
+    threadpool_task_predecessor_done (threadpool, &elem->task, result);
+    if (--elem->task.nb_predecessors)
+      continue;
+    threadpool_queue_unlink (threadpool, elem);        // Unlinks the element from the blocked tasks.
+    if (elem->task.work && (elem->task.predecessor_failed || threadpool_is_short_circuited_predicate (threadpool)))
+    {
+      elem->task.work = 0;      // The job won't be processed by thread_worker_runner.
+      threadpool_pending_tasks_done (threadpool, 1);
+      threadpool->nb_canceled_tasks++;
+    }
+    if (!worker)                // Released by a thread which is not a worker of the thread pool (processed inline): onto the shared FIFO.
+      threadpool_fifo_push (threadpool, 0, elem);
+    else                        // Released onto the local deque of the worker (hot in cache), from which other workers can steal it.
+    {
+      thrd_honored (mtx_lock (&worker->mutex));
+      elem_push (&worker->top, &worker->bottom, elem);
+      worker->nb_elems++;
+      threadpool->nb_queued_elems++;
+      thrd_honored (mtx_unlock (&worker->mutex));
+    }
+    nb_released++;
+  }
+  if (!worker && nb_released)   // No worker will process any of them by itself.
+    threadpool_wake_up_or_start_workers (threadpool, nb_released);
+  else if (nb_released > 1)     // The worker will process one of them itself.
+    threadpool_wake_up_or_start_workers (threadpool, nb_released - 1);
+  if (future->nb_waiters)
+  {
+    thrd_honored (cnd_broadcast (&threadpool->futures.completed));
+    for (struct worker * worker = threadpool->parked, *next; worker; worker = next)
+    {
+      next = worker->parked_next;
+      if (worker->waited_future == future)
+      {
+        threadpool_worker_unpark (threadpool, worker);
+        thrd_honored (cnd_signal (&worker->wake_up));
+      }
+    }
+  }
+  struct future reclaimed;
+  if (future->detached)         // Reclaimed at once (or by the last waiter), as its result won't be retrieved.
+    map_find_key (threadpool->futures.map, &future->id, future_reclaim_operator, &reclaimed, 0, 0);
+}
+
+// Wakes up the threads waiting for the thread pool to be idle (in threadpool_wait_all). Called with threadpool->mutex locked.
+static void
+threadpool_signal_idle (struct threadpool *threadpool)
+{
+  thrd_honored (cnd_broadcast (&threadpool->idle));
+  for (struct worker * worker = threadpool->parked, *next; worker; worker = next)
+  {
+    next = worker->parked_next;
+    if (worker->waits_for_idle) // Borrowed worker (see threadpool_worker_borrow).
+    {
+      threadpool_worker_unpark (threadpool, worker);
+      thrd_honored (cnd_signal (&worker->wake_up));
+    }
+  }
+}
+
+// ================= Adaptive number of workers =================
+// Hill climbing: every CONTROLLER_INTERVAL, the throughput of completed tasks is measured, and the target number of workers
+// is moved by one worker, in the same direction as before if the throughput has increased, in the opposite one if it has decreased,
+// and downwards if it has not changed (fewer workers for the same throughput).
+// The target is enforced by the lazy start of workers (see threadpool_free_slot) and the retirement of surplus ones (see thread_worker_runner).
+// Called with threadpool->mutex locked, when a task completes.
+static void
+threadpool_controller_step (struct threadpool *threadpool)
+{
+  struct timespec now;
+  timespec_get (&now, TIME_UTC);
+  double elapsed = elapsed_seconds (&threadpool->controller.time, &now);
+  if (elapsed < CONTROLLER_INTERVAL)
+    return;
+  size_t nb_completed = threadpool->nb_succeeded_tasks + threadpool->nb_failed_tasks + threadpool->nb_canceled_tasks;
+  double throughput = (double) (nb_completed - threadpool->controller.nb_completed) / elapsed;
+  double previous = threadpool->controller.throughput;
+  threadpool->controller.time = now;
+  threadpool->controller.nb_completed = nb_completed;
+  threadpool->controller.throughput = throughput;
+  if (!threadpool->nb_pending_tasks)    // Throughput is limited by the submission of tasks rather than by the number of workers: nothing to learn.
+    return;
+  if (throughput < previous * (1. - CONTROLLER_NOISE))
+    threadpool->controller.direction = -threadpool->controller.direction;       // Worse: go back.
+  else if (throughput <= previous * (1. + CONTROLLER_NOISE))
+    threadpool->controller.direction = -1;      // Unchanged: spare a worker.
+  size_t target = threadpool->target_nb_workers;
+  if ((threadpool->controller.direction > 0 && target >= threadpool->controller.max) || (threadpool->controller.direction < 0 && target <= threadpool->controller.min))
+    threadpool->controller.direction = -threadpool->controller.direction;       // At a bound: probe the other way.
+  if (threadpool->controller.direction > 0 && target < threadpool->controller.max)
+    target++;
+  else if (threadpool->controller.direction < 0 && target > threadpool->controller.min)
+    target--;
+  if (target == threadpool->target_nb_workers)  // min_workers == max_workers.
+    return;
+  threadpool->target_nb_workers = target;
+  if (threadpool->nb_alive_workers > threadpool_max_nb_alive_workers (threadpool))      // Parked surplus workers retire at once, busy ones once they have completed their task.
+    threadpool_wake_up_parked_workers (threadpool, threadpool->nb_alive_workers - threadpool_max_nb_alive_workers (threadpool));
+  else if (threadpool_something_to_process_predicate (threadpool))
+    threadpool_wake_up_or_start_workers (threadpool, 1);
+  threadpool_monitor_call (threadpool, 1);      // Decisions are logged.
+}
+
+// Processes an element popped from a queue by the calling worker, and releases it.
+// Called with threadpool->mutex locked, which is released while the work is processed.
+static void
+threadpool_process_elem (struct threadpool *threadpool, struct elem *old_elem)
+{
+  if (threadpool->nb_idle_workers && threadpool_something_to_process_predicate (threadpool))
+    threadpool_wake_up_parked_workers (threadpool, 1);  // Elements submitted without locking might have been left behind: pass the baton.
+  tp_result_t ret = TP_JOB_CANCELED;
+  if (old_elem->task.work)
+  {
+    if (old_elem->task.fiber)   // Suspended task to be resumed.
+    {
+      assert (threadpool->nb_async_tasks--);
+      if (!threadpool->nb_async_tasks)  // Workers parked without timeout while there were asynchronous tasks are woken up, to park again with a timeout.
+        threadpool_wake_up_parked_workers (threadpool, SIZE_MAX);
+    }
+    else
+    {
+      threadpool_pending_tasks_done (threadpool, 1);
+#ifdef __GLIBC__
+      if (threadpool->fibers.stack_size)
+        old_elem->task.fiber = threadpool_fiber_alloc (threadpool);     // Run on the thread of the worker if out of memory.
+#endif
+    }
+    threadpool->nb_processing_tasks++;  // The extracted data has to be processed somewhere.
+    threadpool_monitor_call (threadpool, 0);    // Processing worker
+    struct task *current_task = Worker_context.current_task;    // Not null if the worker processes the task while it waits for another one (threadpool_task_wait).
+    Worker_context.current_task = &old_elem->task;      // Used if 'threadpool_task_continuation' or 'threadpool_task_cancel_requested' is called in a task.
+    elem_push (&threadpool->running.in, &threadpool->running.out, old_elem);    // The running task can be asked to stop (see threadpool_cancel_task).
+    threadpool->running.nb_elems++;
+    thrd_honored (mtx_unlock (&threadpool->mutex));     // Unlock
+#ifdef __GLIBC__
+    if (old_elem->task.fiber)
+      ret = threadpool_fiber_run (old_elem->task.fiber);        //<<<<<<<<<< work, on a fiber, until done or suspended <<<<<<<<<<<
+    else
+#endif
+      ret = old_elem->task.work (old_elem->task.job.data);      //<<<<<<<<<< work <<<<<<<<<<< (N.B.: work could itself add tasks by calling 'threadpool_add_task').
+    thrd_honored (mtx_lock (&threadpool->mutex));       // Relock
+#ifdef __GLIBC__
+    if (old_elem->task.fiber && old_elem->task.fiber->state != FIBER_DONE)     // Suspended: the task is resumed later, by any worker.
+    {
+      elem_unlink (&threadpool->running.in, &threadpool->running.out, old_elem);
+      threadpool->running.nb_elems--;
+      Worker_context.current_task = current_task;
+      assert (threadpool->nb_processing_tasks--);
+      threadpool->nb_async_tasks++;
+      threadpool_fiber_suspend (threadpool, old_elem);
+      threadpool_monitor_call (threadpool, 0);
+      return;
+    }
+    if (old_elem->task.fiber)
+    {
+      threadpool_fiber_free (threadpool, old_elem->task.fiber);
+      old_elem->task.fiber = 0;
+    }
+#endif
+    if (old_elem->task.spawned) // A task is not completed before its spawned children.
+      threadpool_task_sync (threadpool, &old_elem->task);
+    elem_unlink (&threadpool->running.in, &threadpool->running.out, old_elem);
+    threadpool->running.nb_elems--;
+    if (ret != TP_JOB_SUCCESS)
+      old_elem->task.to_be_continued = 0;       // We won't consider the continuation
+    Worker_context.current_task = current_task;
+    assert (threadpool->nb_processing_tasks--);
+  }                             // if (old_elem->task.work)
+  // Update ret with the result of the job deletor (which can hold aggregation)
+  if (!old_elem->task.to_be_continued && old_elem->task.job.data_delete)        // Call to task.job.data_delete is MT-safe (guarded by threadpool->mutex)
+    ret = old_elem->task.job.data_delete (old_elem->task.job.data, ret);        // Note (*): get rid of job after use (and if it is not scheduled in a continuation).
+  if (old_elem->task.work && !old_elem->task.to_be_continued)   // For a continuation task, we have to wait for the continuation before we know the final result.
+  {
+    if (ret == TP_JOB_FAILURE)
+      threadpool->nb_failed_tasks++;
+    else if (ret == TP_JOB_SUCCESS)
+      threadpool->nb_succeeded_tasks++;
+    else if (ret == TP_JOB_CANCELED)
+      threadpool->nb_canceled_tasks++;
+    if ((threadpool->property == TP_RUN_ALL_SUCCESSFUL_TASKS && ret == TP_JOB_FAILURE) || (threadpool->property == TP_RUN_ONE_SUCCESSFUL_TASK && ret == TP_JOB_SUCCESS))
+      threadpool_cancel_task (threadpool, TP_CANCEL_ALL_PENDING_TASKS); // Cancel automatically other already submitted tasks (threadpool->mutex is mtx_recursive)
+  }
+  if (old_elem->task.future && !old_elem->task.to_be_continued)
+    threadpool_future_complete (threadpool, old_elem->task.future, ret);
+  if (old_elem->task.parent && !old_elem->task.to_be_continued)
+    threadpool_child_complete (threadpool, &old_elem->task);
+  if (old_elem->task.work && threadpool->controller.max)
+    threadpool_controller_step (threadpool);
+  if (old_elem->task.work)
+    threadpool_monitor_call (threadpool, 0);
+  threadpool_elem_free (threadpool, old_elem);
+  if (threadpool->nb_idle_waiters && threadpool_is_idle_predicate (threadpool))
+    threadpool_signal_idle (threadpool);
+}
+
+// Returns the free slot to be registered next, the most recently freed one, or 0 if all slots are active
+// or if as many workers as requested, and as compensating workers, are alive. Called with threadpool->mutex locked.
+static struct worker *
+threadpool_free_slot (struct threadpool *threadpool)
+{
+  return threadpool->nb_free_slots && threadpool->nb_alive_workers < threadpool_max_nb_alive_workers (threadpool) ?
+    threadpool->free_slots[threadpool->nb_free_slots - 1] : 0;
+}
+
+// Registers an active worker in the free slot returned by threadpool_free_slot. Called with threadpool->mutex locked.
+static void
+threadpool_worker_register (struct threadpool *threadpool, struct worker *worker)
+{
+  assert (threadpool->nb_free_slots && threadpool->free_slots[threadpool->nb_free_slots - 1] == worker);
+  threadpool->nb_free_slots--;  // Popped from the stack of free slots.
+  if (threadpool->nb_used_slots <= (size_t) (worker - threadpool->worker))
+    threadpool->nb_used_slots = (size_t) (worker - threadpool->worker) + 1;
+  worker->active = 1;           // Register active worker.
+  if (threadpool->nb_alive_workers == 0 && threadpool->resource.allocator && !threadpool->resource.data)
+  {
+    threadpool_monitor_call (threadpool, 0);
+    threadpool->resource.data = threadpool->resource.allocator (threadpool->global_data);
+  }
+  threadpool->nb_alive_workers++;
+  if (threadpool->max_nb_workers < threadpool->nb_alive_workers)
+    threadpool->max_nb_workers = threadpool->nb_alive_workers;
+}
+
+// Unregisters an active worker, and frees its slot. Called with threadpool->mutex locked.
+static void
+threadpool_worker_unregister (struct threadpool *threadpool, struct worker *worker)
+{
+  worker->active = 0;           // Unregister active worker.
+  threadpool->free_slots[threadpool->nb_free_slots++] = worker; // Pushed on the stack of free slots.
+  assert (threadpool->nb_alive_workers--);
+  threadpool_monitor_call (threadpool, 0);
+  if (threadpool->nb_alive_workers == 0 && threadpool->resource.deallocator)
+  {
+    threadpool->resource.deallocator (threadpool->resource.data);
+    threadpool->resource.data = 0;
+    threadpool_monitor_call (threadpool, 0);
+  }
+  if (threadpool_runoff_predicate (threadpool)) // The last worker is quitting:
+    thrd_honored (cnd_signal (&threadpool->runoff));    //  signals it.
+}
+
+// The calling thread starts running as the registered worker 'worker'. Its previous context is saved in 'saved' (see threadpool_worker_leave).
+// Called with threadpool->mutex locked.
+static void
+threadpool_worker_enter (struct threadpool *threadpool, struct worker *worker, struct worker_context *saved)
+{
+  *saved = Worker_context;
+  Worker_context = (struct worker_context) {.threadpool = threadpool,.worker = worker,.current_task = 0 };    // Thread local variable
+  Worker_context.worker_no = ++threadpool->nb_created_workers;
+  Worker_context.local_data = threadpool->worker_local_data_manager.make ? threadpool->worker_local_data_manager.make () : 0;   // Call to threadpool->worker_local_data.make is thread-safe.
+}
+
+// The calling thread stops running as the worker 'worker', unregistered, and gets its previous context back. Called with threadpool->mutex locked.
+static void
+threadpool_worker_leave (struct threadpool *threadpool, struct worker *worker, const struct worker_context *saved)
+{
+  void *localdata = Worker_context.local_data;
+  Worker_context.local_data = 0;
+  if (threadpool->worker_local_data_manager.destroy)
+    threadpool->worker_local_data_manager.destroy (localdata);
+  if (worker->nb_elems)         // Left by a borrowed worker (see threadpool_worker_borrow): to be stolen by other workers.
+    threadpool_wake_up_or_start_workers (threadpool, worker->nb_elems);
+  threadpool_worker_unregister (threadpool, worker);
+  thrd_honored (mtx_lock (&threadpool->slab.mutex));
+  threadpool_worker_cache_flush (threadpool, worker, 0);
+  thrd_honored (mtx_unlock (&threadpool->slab.mutex));
+  Worker_context = *saved;
+}
+
+// Number of alive workers which are never ended by the idle timeout.
+#define threadpool_nb_warm_workers(threadpool) ((threadpool)->min_workers > (threadpool)->retirement.floor ? (threadpool)->min_workers : (threadpool)->retirement.floor)
+
+// Number of past retirements which lengthen the delay before the next retirement of an idle worker.
+// Called with threadpool->mutex locked.
+static unsigned int
+threadpool_retirement_backoff (const struct threadpool *threadpool, const struct timespec *now)
+{
+  return elapsed_seconds (&threadpool->retirement.time, now) >= 2 * threadpool->retirement.max_delay ? 0 : // No retirement for long: the thread pool is steady, the delay is reset.
+    threadpool->retirement.nb;
+}
+
+// Delay between two retirements of idle workers, doubling from the idle timeout with each of the 'backoff' past retirements up to retirement.max_delay.
+static double
+threadpool_retirement_delay (const struct threadpool *threadpool, unsigned int backoff)
+{
+  double delay = threadpool->idle_timeout;
+  for (unsigned int i = 0; i < backoff && delay > 0. && delay < threadpool->retirement.max_delay; i++)
+    delay *= 2;
+  return delay > threadpool->retirement.max_delay ? threadpool->retirement.max_delay : delay;
+}
+
+// Returns 1 if an idle worker, whose idle timeout has expired, can retire now.
+// With hysteresis (see threadpool_set_idle_retirement), workers retire one at a time, after the delay since the last retirement;
+// otherwise, 'timeout' is set to the time the worker can retire, and 0 is returned. Called with threadpool->mutex locked.
+static int
+threadpool_worker_may_retire (const struct threadpool *threadpool, struct timespec *timeout)
+{
+  if (threadpool->retirement.max_delay <= 0.)
+    return 1;
+  struct timespec now;
+  timespec_get (&now, TIME_UTC);
+  double elapsed = elapsed_seconds (&threadpool->retirement.time, &now);
+  double delay = threadpool_retirement_delay (threadpool, threadpool_retirement_backoff (threadpool, &now));
+  if (elapsed >= delay)
+    return 1;
+  *timeout = delay_to_abs_timespec (delay - elapsed);   // from timers.h
+  return 0;
+}
+
+// Records the retirement of an idle worker, which delays the next one. Called with threadpool->mutex locked, when the worker leaves.
+static void
+threadpool_worker_retired (struct threadpool *threadpool)
+{
+  if (threadpool->retirement.max_delay <= 0.)
+    return;
+  struct timespec now;
+  timespec_get (&now, TIME_UTC);
+  unsigned int backoff = threadpool_retirement_backoff (threadpool, &now);
+  double delay = threadpool_retirement_delay (threadpool, backoff);
+  threadpool->retirement.time = now;
+  threadpool->retirement.nb = delay > 0. && delay < threadpool->retirement.max_delay ? backoff + 1 : backoff;
+}
+
+// Whether a worker retires before the thread pool is done, and why (idle timeout, or surplus worker after a blocking region).
+enum
+{ WORKER_ACTIVE, WORKER_RETIRED_IDLE, WORKER_RETIRED_SURPLUS };
+
+static int
+thread_worker_runner (void *args)
+{
+  thrd_detach (thrd_current ());        // Asks for disposing of any resources allocated to the worker thread when it terminates.
+  struct worker *worker = args;
+  struct threadpool *threadpool = worker->threadpool;
+  worker->stack_size = 0;
+#ifdef __GLIBC__
+  threadpool_worker_pin (worker);
+  pthread_attr_t attr;
+  if (!pthread_getattr_np (pthread_self (), &attr))
+  {
+    pthread_attr_getstacksize (&attr, &worker->stack_size);     // The guard area is not counted.
+    pthread_attr_destroy (&attr);
+  }
+#endif
+  struct worker_context saved;
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  threadpool_worker_enter (threadpool, worker, &saved);
+  threadpool->stack.nb_bytes += worker->stack_size;
+  int retire = WORKER_ACTIVE;   // Set when the worker retires before the thread pool is done.
+  while (1)                     // Looping on tasks (concurrently with other workers)
+  {
+    struct timespec timeout = delay_to_abs_timespec (threadpool->idle_timeout); // from timers.h
+    threadpool->nb_idle_workers++;      // N.B.: incremented before the predicate is checked, see threadpool_create_task.
+    if (threadpool->idle_spin > 0. && !threadpool_something_to_process_predicate (threadpool) && !threadpool_is_done_predicate (threadpool))
+      threadpool_idle_spin (threadpool);        // Spin, then park.
+    while (!threadpool_something_to_process_predicate (threadpool) && !threadpool_is_done_predicate (threadpool))       // Predicate is not fulfilled: wait in idle state.
+    {
+      threadpool_monitor_call (threadpool, 0);
+      int cnd;
+      if (threadpool->fibers.sleeping.nb_elems)       // Wait for the earliest wake-up time of the sleeping tasks, and wake them up.
+      {
+        struct timespec wake_up = threadpool->fibers.sleeping.out->time;
+        thrd_honored (threadpool_worker_park (threadpool, worker, &wake_up));
+        threadpool_fiber_wake_up (threadpool);
+      }
+      else if (threadpool->nb_async_tasks)
+        thrd_honored (threadpool_worker_park (threadpool, worker, 0));  // Wait for continuators to be processed (threadpool_task_continue) or to timeout (threadpool_task_continuation_timeout_handler).
+      else if ((cnd = threadpool_worker_park (threadpool, worker, threadpool->nb_alive_workers > threadpool_nb_warm_workers (threadpool) ? &timeout : 0)) == thrd_timedout)  // Wait for the worker to be woken up or until after the TIME_UTC-based calendar time pointed to by &timeout
+      {
+        if (threadpool->nb_alive_workers > threadpool_nb_warm_workers (threadpool) && !threadpool_something_to_process_predicate (threadpool)
+            && threadpool_worker_may_retire (threadpool, &timeout))
+        {
+          retire = WORKER_RETIRED_IDLE;
+          break;                // Timeout: time to end the worker.
+        }
+      }                         // Otherwise, other workers have ended in the meantime (the worker is kept warm), a task has arrived, or it is not its turn to retire yet.
+      else
+        thrd_honored (cnd);
+      if (threadpool->nb_alive_workers > threadpool_max_nb_alive_workers (threadpool))
+      {
+        retire = WORKER_RETIRED_SURPLUS;
+        break;                  // A blocking region has ended: the surplus worker retires.
+      }
+    }                           // while (!threadpool_something_to_process_predicate (threadpool) && !threadpool_is_done_predicate (threadpool))
+    if (worker->parked)         // Spurious wake-up.
+      threadpool_worker_unpark (threadpool, worker);
+    assert (threadpool->nb_idle_workers--);
+    if (retire == WORKER_ACTIVE && threadpool_something_to_process_predicate (threadpool))    // First condition of the predicate is true (both conditions can't be true at the same time by design.)
+    {
+      struct elem *old_elem = threadpool_next_elem (threadpool);
+      if (!old_elem)
+        continue;               // The element was taken by another worker (the predicate is checked again).
+      threadpool_process_elem (threadpool, old_elem);
+      if (threadpool->nb_alive_workers > threadpool_max_nb_alive_workers (threadpool))
+      {
+        retire = WORKER_RETIRED_SURPLUS;
+        break;                  // A blocking region has ended: the compensating worker retires.
+      }
+      continue;                 // while (1) 
+    }                           // if (retire == WORKER_ACTIVE && threadpool_something_to_process_predicate (threadpool))
+    else if (threadpool_is_done_predicate (threadpool)) // Second condition of the predicate is true: 
+      threadpool_wake_up_parked_workers (threadpool, SIZE_MAX); // wake up all parked workers to finish them.
+    break;                      // Work is done or the predicate was not fulfilled due to timeout. Quit.
+  }                             // while (1)
+  if (retire != WORKER_ACTIVE)
+    threadpool->nb_reaped_workers++;
+  if (retire == WORKER_RETIRED_IDLE)
+    threadpool_worker_retired (threadpool);
+  threadpool->stack.nb_bytes -= worker->stack_size;
+  threadpool_worker_leave (threadpool, worker, &saved); // Its local deque is empty.
+  if (retire == WORKER_RETIRED_SURPLUS && threadpool_something_to_process_predicate (threadpool))
+    threadpool_wake_up_or_start_workers (threadpool, 1);        // The surplus worker might have been woken up for a task: the baton is passed.
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  return 1;
+}
+
+#ifdef __GLIBC__
+static void *
+thread_worker_runner_with_attr (void *args)
+{
+  thread_worker_runner (args);
+  return 0;
+}
+#endif
+
+// Starts the thread of a worker in its slot, with the stack attributes of the thread pool if they are set.
+// Returns thrd_success or thrd_error (or thrd_nomem).
+static int
+threadpool_worker_start (struct threadpool *threadpool, struct worker *worker)
+{
+#ifdef __GLIBC__
+  if (threadpool->stack.set)    // The C11 thrd_create does not give control over the stack: the POSIX thread under thrd_t is created directly.
+  {
+    pthread_attr_t attr;
+    if (pthread_attr_init (&attr))
+      return thrd_nomem;
+    int ret = (threadpool->stack.size && pthread_attr_setstacksize (&attr, threadpool->stack.size))
+      || (threadpool->stack.guard_size && pthread_attr_setguardsize (&attr, threadpool->stack.guard_size))
+      || pthread_create (&worker->id, &attr, thread_worker_runner_with_attr, worker) ? thrd_error : thrd_success;
+    pthread_attr_destroy (&attr);
+    return ret;
+  }
+#endif
+  return thrd_create (&worker->id, thread_worker_runner, worker);
+}
+
+// ================= Nested thread pools =================
+// A thread waiting for a thread pool it is not a worker of, while it is a worker of another thread pool (nested thread pools),
+// joins the thread pool as a borrowed worker, in a free slot, to process its tasks in place rather than block.
+// A thread pool can also borrow the workers of a lender thread pool rather than start new threads (see threadpool_borrow_workers):
+// guest tasks, submitted to the lender, join the thread pool the same way, and return to the lender as soon as there is nothing left to process.
+
+// Claims a free slot for the calling thread, which then runs as a worker of the thread pool until threadpool_worker_leave is called.
+// Returns 0 if all slots are active. Called with threadpool->mutex locked.
+static struct worker *
+threadpool_worker_borrow (struct threadpool *threadpool, struct worker_context *saved)
+{
+  struct worker *worker = threadpool_free_slot (threadpool);
+  if (worker)
+  {
+    threadpool_worker_register (threadpool, worker);
+    threadpool_worker_enter (threadpool, worker, saved);
+  }
+  return worker;
+}
+
+// Indicates that the calling thread is a worker of a thread pool other than 'threadpool'.
+#define threadpool_is_foreign_worker(threadpool) (Worker_context.worker && Worker_context.threadpool != (threadpool))
+
+// Job of a guest task, submitted to the lender.
+static tp_result_t
+threadpool_guest_worker (void *job)
+{
+  struct threadpool *threadpool = job;
+  struct worker_context saved;
+  struct worker *worker;
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  if (!threadpool_is_done_predicate (threadpool) && threadpool_something_to_process_predicate (threadpool)
+      && (worker = threadpool_worker_borrow (threadpool, &saved)))
+  {
+    for (struct elem * elem; threadpool_something_to_process_predicate (threadpool);)  // Never parks: the worker of the lender returns at once.
+      if ((elem = threadpool_next_elem (threadpool)))
+        threadpool_process_elem (threadpool, elem);
+    if (threadpool_is_done_predicate (threadpool))
+      threadpool_wake_up_parked_workers (threadpool, SIZE_MAX);
+    threadpool_worker_leave (threadpool, worker, &saved);
+  }
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  return TP_JOB_SUCCESS;
+}
+
+static void threadpool_release (struct threadpool *threadpool);
+
+// Called with lender->mutex locked (threadpool->mutex must not be locked here).
+static tp_result_t
+threadpool_guest_worker_delete (void *job, tp_result_t result)
+{
+  threadpool_release (job);     // The thread pool might have been destroyed by its owner in the meantime.
+  return result;
+}
+
+// Submits a guest task to the lender, to process new elements. Returns 0 if the lender refused it. Called with threadpool->mutex locked.
+static int
+threadpool_invite_guest (struct threadpool *threadpool)
+{
+  threadpool->nb_references++;
+  if (threadpool_add_task (threadpool->lender, threadpool_guest_worker, threadpool, threadpool_guest_worker_delete))
+    return 1;
+  threadpool->nb_references--;
+  return 0;
+}
+
+// Wakes up idle workers, or starts new ones if none are idle, to process 'nb_elems' new elements. Called with threadpool->mutex locked.
+static void
+threadpool_wake_up_or_start_workers (struct threadpool *threadpool, size_t nb_elems)
+{
+  size_t nb_workers = threadpool->nb_idle_workers;      // Idle workers are either parked, or spinning, or about to check for tasks before they park.
+  threadpool_wake_up_parked_workers (threadpool, nb_elems);     // Wake up as many parked workers as there are new elements.
+  if (threadpool->lender)      // Guest tasks (not started yet or running) count as workers on their way.
+  {
+    for (nb_workers += threadpool->nb_references - 1; nb_workers < nb_elems && threadpool->nb_references - 1 < threadpool->requested_nb_workers; nb_workers++)
+      if (!threadpool_invite_guest (threadpool))
+        break;                  // Refused by the lender (being destroyed): own workers are started instead.
+    if (nb_workers >= nb_elems || threadpool->nb_references - 1 >= threadpool->requested_nb_workers)
+      return;                   // No thread of its own.
+  }
+  if (threadpool->spawner.started)      // Workers are started asynchronously, outside of threadpool->mutex, by the spawner thread.
+  {
+    nb_workers += threadpool->spawner.nb_workers;       // Workers on their way.
+    for (struct worker * worker; nb_workers < nb_elems && (worker = threadpool_free_slot (threadpool)); nb_workers++)
+    {
+      threadpool_worker_register (threadpool, worker);  // Taken into account by threadpool_runoff_predicate at once.
+      worker->next_to_be_spawned = threadpool->spawner.workers;
+      threadpool->spawner.workers = worker;
+      threadpool->spawner.nb_workers++;
+    }
+    if (threadpool->spawner.nb_workers)
+      thrd_honored (cnd_signal (&threadpool->spawner.request));
+    return;
+  }
+  for (struct worker * worker; nb_workers < nb_elems && (worker = threadpool_free_slot (threadpool))        // Not enough workers are idle and available to process the new tasks at once:
+       && threadpool_worker_start (threadpool, worker) == thrd_success; nb_workers++)      // start a worker in a free slot.
+    // Note: a new worker thread has been created by thrd_create, but thread_worker_runner might not be launched right away.
+    // Anyway, the worker has to be taken into consideration by the predicate threadpool_runoff_predicate with threadpool->nb_alive_workers++ to
+    // let the thread pool know a new worker in on its way. This can not be deferred at the beginning of thread_worker_runner.
+    threadpool_worker_register (threadpool, worker);
+}
+
+// Wakes up an idle worker, or starts a new one if none is idle. Called with threadpool->mutex locked.
+static void
+threadpool_wake_up_or_start_worker (struct threadpool *threadpool)
+{
+  threadpool_wake_up_or_start_workers (threadpool, 1);
+}
+
+// Reserves 'nb' contiguous task ids and returns the first one.
+static size_t
+threadpool_new_task_ids (struct threadpool *threadpool, size_t nb)
+{
+  size_t id = threadpool->nb_created_tasks, first, last;
+  do
+  {
+    first = id + 1;             // task.id starts from 1.
+    if (TP_CANCEL_ALL_PENDING_TASKS - first < nb)
+      first = 1;                // Wraps around on overflow.
+    last = first + nb - 1;
+  }
+  while (!atomic_compare_exchange_weak (&threadpool->nb_created_tasks, &id, last));
+  return first;
+}
+
+static size_t
+threadpool_new_task_id (struct threadpool *threadpool)
+{
+  return threadpool_new_task_ids (threadpool, 1);
+}
+
+// Initialises the task of a new element and counts it.
+// The continuation of a task ('continued' not null) keeps the id and the completion record of the continued task.
+// Called with threadpool->mutex locked, or the mutex of the local deque in which the element is about to be pushed, or before the element is pushed in the submission ring.
+static void
+threadpool_init_task (struct threadpool *threadpool, struct elem *new_elem, size_t id, tp_result_t (*work) (void *job), void *job,
+                      tp_result_t (*job_delete) (void *job, tp_result_t result), const struct task *continued, struct future *future)
+{
+  int is_continuation = continued != 0;
+  if (!is_continuation)
+    if (threadpool_is_short_circuited_predicate (threadpool))
+      work = 0;                 // Cancel automatically new submitted tasks.
+
+  struct task task = {.job.data = job,.work = work,.job.data_delete = job_delete,.to_be_continued = 0,.is_continuation = is_continuation,
+    .id = is_continuation ? continued->id : id,.future = is_continuation ? continued->future : future,
+    .cancel_requested = is_continuation ? continued->cancel_requested : 0,.parent = is_continuation ? continued->parent : 0,.nb_children = 0,.spawned = 0
+  };
+  new_elem->task = task;
+  new_elem->queue = 0;          // Not indexed yet.
+  if (future)
+  {
+    *future = (struct future) {.id = id,.done = 0,.detached = 0,.nb_waiters = 0,.reclaimed = 0,.successors = 0 };
+    map_insert_data (threadpool->futures.map, future);  // The map is MT-safe, and ids are unique.
+  }
+  if (!is_continuation)         // A continuation need not be counted again.
+    threadpool->nb_submitted_tasks++;
+  if (work)
+    threadpool->nb_pending_tasks++;
+  else
+    threadpool->nb_canceled_tasks++;
+}
+
+// Wakes up an idle worker or starts a new one, if needed, after an element was queued without locking threadpool->mutex.
+// The element has been published before nb_idle_workers is read, and idle workers increment nb_idle_workers before they check
+// for something to process: either an idle worker sees the new element, or it is seen idle here and woken up.
+static void
+threadpool_wake_up_after_unlocked_push (struct threadpool *threadpool)
+{
+  atomic_thread_fence (memory_order_seq_cst);
+  if (threadpool->nb_idle_workers || threadpool->nb_alive_workers < threadpool_max_nb_alive_workers (threadpool))
+  {
+    thrd_honored (mtx_lock (&threadpool->mutex));
+    threadpool_wake_up_or_start_worker (threadpool);
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+  }
+}
+
+// Applies backpressure before 'nb_tasks' tasks are submitted, if the thread pool already holds its maximum number of pending tasks.
+// Returns 0 if the tasks can be submitted, possibly after the producer has waited (TP_BACKPRESSURE_BLOCK),
+// or the policy TP_BACKPRESSURE_FAIL or TP_BACKPRESSURE_RUN_INLINE to be applied by the caller.
+// A worker of the thread pool (or of another one, see threadpool_worker_borrow) does not wait: it processes pending tasks meanwhile,
+// and submits anyway if there is nothing it could process (the pending tasks are blocked or held by running workers), rather than deadlock.
+static tp_backpressure_t
+threadpool_throttle (struct threadpool *threadpool, size_t nb_tasks)
+{
+  size_t max_pending = threadpool->backpressure.max_pending;
+  if (!max_pending || threadpool->nb_pending_tasks + nb_tasks <= max_pending)   // Lock-free check.
+    return 0;
+  threadpool->backpressure.nb_throttled++;
+  tp_backpressure_t policy = threadpool->backpressure.policy;
+  if (policy != TP_BACKPRESSURE_BLOCK)
+    return policy;
+  struct timespec from, to;
+  timespec_get (&from, TIME_UTC);
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  struct worker_context saved;
+  struct worker *worker = Worker_context.worker, *borrowed = 0;
+  if (worker && worker->threadpool != threadpool)
+    worker = borrowed = threadpool_worker_borrow (threadpool, &saved);
+  while (threadpool->backpressure.max_pending && threadpool->nb_pending_tasks && threadpool->nb_pending_tasks + nb_tasks > threadpool->backpressure.max_pending
+         && threadpool->backpressure.policy == TP_BACKPRESSURE_BLOCK)
+  {
+    struct elem *elem;
+    if (worker && threadpool_something_to_process_predicate (threadpool) && (elem = threadpool_next_elem (threadpool)))
+      threadpool_process_elem (threadpool, elem);
+    else if (worker)
+      break;                    // Nothing to process: submitted anyway.
+    else
+    {
+      threadpool->backpressure.nb_waiters++;
+      thrd_honored (cnd_wait (&threadpool->backpressure.not_full, &threadpool->mutex));
+      threadpool->backpressure.nb_waiters--;
+    }
+  }
+  if (!worker && threadpool->backpressure.nb_waiters && threadpool->nb_pending_tasks + nb_tasks < threadpool->backpressure.max_pending)
+    thrd_honored (cnd_signal (&threadpool->backpressure.not_full));     // Room left for another producer: pass the baton.
+  if (borrowed)
+    threadpool_worker_leave (threadpool, borrowed, &saved);
+  timespec_get (&to, TIME_UTC);
+  threadpool->backpressure.waiting_time += elapsed_seconds (&from, &to);
+  threadpool_monitor_call (threadpool, 0);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  return 0;
+}
+
+// Processes a task at once, on the calling thread, rather than submitting it (TP_BACKPRESSURE_RUN_INLINE).
+// A thread which is not a worker of the thread pool processes the task as if it were a worker, though without worker local data.
+// Called with threadpool->mutex locked.
+static void
+threadpool_process_inline (struct threadpool *threadpool, struct elem *elem)
+{
+  struct worker_context saved = Worker_context;
+  if (Worker_context.threadpool != threadpool)
+    Worker_context = (struct worker_context) {.threadpool = threadpool };
+  threadpool_process_elem (threadpool, elem);
+  Worker_context = saved;
+}
+
+static size_t
+threadpool_create_task (struct threadpool *threadpool, tp_result_t (*work) (void *job), void *job, tp_result_t (*job_delete) (void *job, tp_result_t result),
+                        const struct task *continued, size_t priority, const struct timespec *deadline, struct task *parent)
+{
+  tp_backpressure_t throttled = continued || parent ? 0 : threadpool_throttle (threadpool, 1);    // Continuations and spawned children (bounded by the nesting of tasks) are not throttled.
+  if (throttled == TP_BACKPRESSURE_FAIL)
+  {
+    errno = EAGAIN;
+    return 0;
+  }
+  struct elem *new_elem = threadpool_elem_alloc (threadpool);
+  struct future *future = 0;
+  if (!new_elem || (!continued && threadpool->futures.map && !(future = malloc (sizeof (*future)))))
+  {
+    if (new_elem)
+      threadpool_elem_free (threadpool, new_elem);
+    fprintf (stderr, "%s: %s\n", __func__, _("Out of memory."));
+    errno = ENOMEM;
+    return 0;
+  }
+  int is_continuation = continued != 0;
+  size_t id;
+  struct worker *worker = Worker_context.worker;
+  if (throttled == TP_BACKPRESSURE_RUN_INLINE)
+  {
+    thrd_honored (mtx_lock (&threadpool->mutex));
+    threadpool_init_task (threadpool, new_elem, threadpool_new_task_id (threadpool), work, job, job_delete, continued, future);
+    id = new_elem->task.id;
+    threadpool_process_inline (threadpool, new_elem);
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+    return id;
+  }
+  if ((parent || (!is_continuation && !priority && !deadline && threadpool->work_stealing)) && worker && worker->threadpool == threadpool)
+  {
+    // Work-stealing: a task submitted by a worker is pushed to its local deque, without locking the thread pool.
+    thrd_honored (mtx_lock (&worker->mutex));
+    threadpool_init_task (threadpool, new_elem, threadpool_new_task_id (threadpool), work, job, job_delete, continued, future);
+    if ((new_elem->task.parent = parent))       // Spawned child (see threadpool_spawn).
+      parent->nb_children++;
+    elem_push (&worker->top, &worker->bottom, new_elem);
+    worker->nb_elems++;
+    threadpool->nb_queued_elems++;
+    id = new_elem->task.id;
+    thrd_honored (mtx_unlock (&worker->mutex));
+    threadpool_wake_up_after_unlocked_push (threadpool);        // Idle workers steal from the local deques of the others.
+    return id;
+  }
+  if (!is_continuation && !priority && !deadline && threadpool->ring.cell && !threadpool->fifo[0].nb_elems)  // The FIFO is used instead as long as it is not empty, to preserve the submission order.
+  {
+    threadpool_init_task (threadpool, new_elem, threadpool_new_task_id (threadpool), work, job, job_delete, continued, future);
+    id = new_elem->task.id;
+    new_elem->next = new_elem->prev = 0;        // Unlinked in the ring.
+    if (threadpool_ring_push (threadpool, new_elem))
+    {
+      if (new_elem->task.work && threadpool_is_short_circuited_predicate (threadpool))
+        threadpool_cancel_task (threadpool, id);        // The thread pool was interrupted in the meantime and might not have seen the task.
+      threadpool_wake_up_after_unlocked_push (threadpool);
+      return id;
+    }
+    thrd_honored (mtx_lock (&threadpool->mutex));       // The ring is full: the FIFO is used instead.
+  }
+  else
+  {
+    thrd_honored (mtx_lock (&threadpool->mutex));
+    threadpool_init_task (threadpool, new_elem, is_continuation ? 0 : threadpool_new_task_id (threadpool), work, job, job_delete, continued, future);
+    id = new_elem->task.id;
+  }
+  if (deadline)
+  {
+    new_elem->time = *deadline;
+    threadpool_deadline_push (threadpool, new_elem);
+  }
+  else
+    threadpool_fifo_push (threadpool, priority, new_elem);
+  threadpool_wake_up_or_start_worker (threadpool);
+  threadpool_monitor_call (threadpool, 0);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  return id;
+}
+
+size_t
+threadpool_add_task (struct threadpool *threadpool, tp_result_t (*work) (void *job), void *job, tp_result_t (*job_delete) (void *job, tp_result_t result))
+{
+  return threadpool_create_task (threadpool, work, job, job_delete, 0, 0, 0, 0);
+}
+
+size_t
+threadpool_add_task_with_priority (struct threadpool *threadpool, size_t priority, tp_result_t (*work) (void *job), void *job,
+                                   tp_result_t (*job_delete) (void *job, tp_result_t result))
+{
+  if (priority >= TP_NB_PRIORITY_LEVELS)
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Invalid argument."));
+    errno = EINVAL;
+    return 0;
+  }
+  return threadpool_create_task (threadpool, work, job, job_delete, 0, priority, 0, 0);
+}
+
+size_t
+threadpool_add_task_with_deadline (struct threadpool *threadpool, double delay, tp_result_t (*work) (void *job), void *job,
+                                   tp_result_t (*job_delete) (void *job, tp_result_t result))
+{
+  if (!(delay >= 0.))
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Invalid argument."));
+    errno = EINVAL;
+    return 0;
+  }
+  struct timespec deadline = delay_to_abs_timespec (delay);     // from timers.h
+  return threadpool_create_task (threadpool, work, job, job_delete, 0, 0, &deadline, 0);
+}
+
+// Queues 'nb_tasks' tasks, of ids 'first' to 'first + nb_tasks - 1', with the elements popped from '*new_elems' (see threadpool_add_tasks).
+static void
+threadpool_queue_tasks (struct threadpool *threadpool, tp_backpressure_t throttled, size_t first, size_t nb_tasks, tp_result_t (*work) (void *job), void *jobs[],
+                        tp_result_t (*job_delete) (void *job, tp_result_t result), struct elem **new_elems)
+{
+  struct worker *worker = Worker_context.worker;
+  int local = threadpool->work_stealing && worker && worker->threadpool == threadpool && throttled != TP_BACKPRESSURE_RUN_INLINE;
+  mtx_t *mutex = local ? &worker->mutex : &threadpool->mutex;
+  thrd_honored (mtx_lock (mutex));
+  size_t nb_queued = 0, nb_signaled = 0;
+  for (size_t i = 0; i < nb_tasks; i++)
+  {
+    struct elem *new_elem = *new_elems;
+    *new_elems = new_elem->next;
+    threadpool_init_task (threadpool, new_elem, first + i, work, jobs[i], job_delete, 0, new_elem->task.future);
+    if (throttled == TP_BACKPRESSURE_RUN_INLINE && new_elem->task.work && threadpool->backpressure.max_pending
+        && threadpool->nb_pending_tasks > threadpool->backpressure.max_pending && threadpool->nb_pending_tasks > 1)     // Only the tasks beyond the bound are processed inline.
+    {
+      if (nb_queued > nb_signaled)      // Tasks queued so far are processed meanwhile.
+        threadpool_wake_up_or_start_workers (threadpool, nb_queued - nb_signaled);
+      nb_signaled = nb_queued;
+      threadpool_process_inline (threadpool, new_elem);
+    }
+    else
+    {
+      if (local)                // Work-stealing: tasks submitted by a worker are pushed to its local deque.
+        elem_push (&worker->top, &worker->bottom, new_elem);
+      else
+        threadpool_fifo_push (threadpool, 0, new_elem);
+      nb_queued++;
+    }
+  }
+  if (local)
+  {
+    worker->nb_elems += nb_tasks;
+    threadpool->nb_queued_elems += nb_tasks;
+    thrd_honored (mtx_unlock (mutex));
+    atomic_thread_fence (memory_order_seq_cst); // See threadpool_wake_up_after_unlocked_push.
+    if (!threadpool->nb_idle_workers && threadpool->nb_alive_workers >= threadpool_max_nb_alive_workers (threadpool))
+      return;
+    thrd_honored (mtx_lock (&threadpool->mutex));
+  }
+  if (nb_queued > nb_signaled)
+    threadpool_wake_up_or_start_workers (threadpool, nb_queued - nb_signaled);
+  threadpool_monitor_call (threadpool, 0);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+size_t
+threadpool_add_tasks (struct threadpool *threadpool, size_t nb_tasks, tp_result_t (*work) (void *job), void *jobs[],
+                      tp_result_t (*job_delete) (void *job, tp_result_t result))
+{
+  if (!nb_tasks)
+    return 0;
+  size_t max_pending = threadpool->backpressure.max_pending;
+  tp_backpressure_t policy = threadpool->backpressure.policy;
+  if (max_pending && nb_tasks > max_pending && policy == TP_BACKPRESSURE_FAIL)  // The batch would never fit under the bound.
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Invalid argument."));
+    errno = EINVAL;
+    return 0;
+  }
+  size_t chunk = max_pending && nb_tasks > max_pending && policy == TP_BACKPRESSURE_BLOCK ? max_pending : nb_tasks;      // A larger batch is admitted by chunks.
+  tp_backpressure_t throttled = threadpool_throttle (threadpool, chunk);
+  if (throttled == TP_BACKPRESSURE_FAIL)
+  {
+    errno = EAGAIN;
+    return 0;
+  }
+  struct elem *new_elems = 0;   // Elements (and completion records) are allocated before locking.
+  for (size_t i = 0; i < nb_tasks; i++)
+  {
+    struct elem *new_elem = threadpool_elem_alloc (threadpool);
+    struct future *future = 0;
+    if (!new_elem || (threadpool->futures.map && !(future = malloc (sizeof (*future)))))
+    {
+      if (new_elem)
+        threadpool_elem_free (threadpool, new_elem);
+      for (struct elem * elem; (elem = new_elems);)
+      {
+        new_elems = elem->next;
+        free (elem->task.future);
+        threadpool_elem_free (threadpool, elem);
+      }
+      fprintf (stderr, "%s: %s\n", __func__, _("Out of memory."));
+      errno = ENOMEM;
+      return 0;
+    }
+    new_elem->task.future = future;
+    new_elem->next = new_elems;
+    new_elems = new_elem;
+  }
+  size_t first = threadpool_new_task_ids (threadpool, nb_tasks);        // Contiguous ids, even if the batch is admitted by chunks.
+  for (size_t i = 0; i < nb_tasks; i += chunk)
+  {
+    size_t nb = nb_tasks - i < chunk ? nb_tasks - i : chunk;
+    if (i && (throttled = threadpool_throttle (threadpool, nb)) == TP_BACKPRESSURE_FAIL)
+      throttled = 0;            // The policy was changed meanwhile: the rest of the admitted batch is submitted anyway.
+    threadpool_queue_tasks (threadpool, throttled, first + i, nb, work, jobs + i, job_delete, &new_elems);
+  }
+  return first;
+}
+
+void
+threadpool_borrow_workers (struct threadpool *threadpool, struct threadpool *lender)
+{
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  if (threadpool->nb_created_tasks || threadpool->concluding)
+  {
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Operation not permitted."));
+    errno = EPERM;
+    return;
+  }
+  if (lender && (lender == threadpool || lender->property != TP_RUN_ALL_TASKS))     // Guest tasks must not be canceled automatically.
+  {
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Invalid argument."));
+    errno = EINVAL;
+    return;
+  }
+  threadpool->lender = lender;
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+void
+threadpool_wait_all (struct threadpool *threadpool)
+{
+  if (Worker_context.threadpool == threadpool)  // A task of the thread pool would wait for itself.
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Operation not permitted."));
+    errno = EPERM;
+    return;
+  }
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  struct worker_context saved;
+  struct worker *worker = threadpool_is_foreign_worker (threadpool) ? threadpool_worker_borrow (threadpool, &saved) : 0;      // Nested thread pools.
+  threadpool->nb_idle_waiters++;
+  while (!threadpool_is_idle_predicate (threadpool))    // Wait for all tasks (either virtual or not) to be processed. Workers are kept alive.
+  {
+    struct elem *elem;
+    if (worker && threadpool_something_to_process_predicate (threadpool) && (elem = threadpool_next_elem (threadpool)))
+      threadpool_process_elem (threadpool, elem);       // A worker of another thread pool does not block: it processes tasks while it waits.
+    else if (worker)            // Nothing to process: the worker parks until the thread pool is idle or a new task is submitted.
+    {
+      worker->waits_for_idle = 1;
+      threadpool->nb_idle_workers++;
+      thrd_honored (threadpool_worker_park (threadpool, worker, 0));
+      if (worker->parked)       // Spurious wake-up.
+        threadpool_worker_unpark (threadpool, worker);
+      assert (threadpool->nb_idle_workers--);
+      worker->waits_for_idle = 0;
+    }
+    else
+      thrd_honored (cnd_wait (&threadpool->idle, &threadpool->mutex));
+  }
+  threadpool->nb_idle_waiters--;
+  if (worker)
+    threadpool_worker_leave (threadpool, worker, &saved);
+  threadpool_monitor_call (threadpool, 1);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+void
+threadpool_wait_and_destroy (struct threadpool *threadpool)
+{
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  threadpool_monitor_call (threadpool, 1);
+  threadpool->concluding = 1;   // Declares that no more tasks will be added into the FIFO by the caller of 'threadpool_wait_and_destroy' (processing workers can still add tasks).
+  struct worker_context saved;
+  struct worker *worker = threadpool_is_foreign_worker (threadpool) ? threadpool_worker_borrow (threadpool, &saved) : 0;      // Nested thread pools.
+  while (worker && !threadpool_is_done_predicate (threadpool))  // A worker of another thread pool does not block: it processes tasks while it waits.
+  {
+    struct elem *elem;
+    if (threadpool_something_to_process_predicate (threadpool) && (elem = threadpool_next_elem (threadpool)))
+      threadpool_process_elem (threadpool, elem);
+    else
+    {
+      threadpool->nb_idle_workers++;
+      thrd_honored (threadpool_worker_park (threadpool, worker, 0));    // Woken up by the worker which finds the thread pool done.
+      if (worker->parked)       // Spurious wake-up.
+        threadpool_worker_unpark (threadpool, worker);
+      assert (threadpool->nb_idle_workers--);
+    }
+  }
+  // The predicate is modified to true (concluding set to 1):
+  if (threadpool_is_done_predicate (threadpool))        // No running tasks (asynchronous or not)
+    threadpool_wake_up_parked_workers (threadpool, SIZE_MAX);   // wake up all parked workers to finish them.
+  if (worker)
+    threadpool_worker_leave (threadpool, worker, &saved);
+  while (!threadpool_runoff_predicate (threadpool))     // Wait for all tasks (either virtual or not) to be processed and all running workers to terminate properly.
+    thrd_honored (cnd_wait (&threadpool->runoff, &threadpool->mutex));
+  if (threadpool->spawner.started)      // No more workers can be requested.
+  {
+    threadpool->spawner.quit = 1;
+    thrd_honored (cnd_signal (&threadpool->spawner.request));
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+    thrd_honored (thrd_join (threadpool->spawner.id, 0));
+    thrd_honored (mtx_lock (&threadpool->mutex));
+  }
+  threadpool_monitor_call (threadpool, 1);
+  if (threadpool->monitor.processor)
+    threadpool_wait_and_destroy (threadpool->monitor.processor);        // Barrier to wait for all monitoring processes to finish.
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  threadpool_release (threadpool);      // Freed now, or by the last guest task still pending in the lender.
+}
+
+// Releases a reference to the thread pool, and frees it when it was the last one.
+static void
+threadpool_release (struct threadpool *threadpool)
+{
+  if (--threadpool->nb_references)
+    return;
+  for (size_t i = 0; i < threadpool->nb_slots; i++)
+  {
+    mtx_destroy (&threadpool->worker[i].mutex);
+    cnd_destroy (&threadpool->worker[i].wake_up);
+    threadpool_frame_pop (&threadpool->worker[i], 0);   // Frees the stack of frames.
+    free (threadpool->worker[i].spare_frames);
+  }
+  free (threadpool->worker);
+  free (threadpool->free_slots);
+  free (threadpool->ring.cell);
+  free (threadpool->index.bucket);
+  if (threadpool->futures.map)  // Completion records which have not been retrieved.
+  {
+    map_traverse (threadpool->futures.map, MAP_REMOVE_ALL, free, 0, 0);
+    map_destroy (threadpool->futures.map);
+  }
+  cnd_destroy (&threadpool->futures.completed);
+  for (struct slab * slab; (slab = threadpool->slab.slabs);)
+  {
+    threadpool->slab.slabs = slab->next;
+    free (slab);
+  }
+  mtx_destroy (&threadpool->slab.mutex);
+  mtx_destroy (&threadpool->mutex);
+  cnd_destroy (&threadpool->runoff);
+  cnd_destroy (&threadpool->idle);
+  cnd_destroy (&threadpool->spawner.request);
+  cnd_destroy (&threadpool->backpressure.not_full);
+#ifdef __GLIBC__
+  for (struct fiber * fiber; (fiber = threadpool->fibers.free);)
+  {
+    threadpool->fibers.free = fiber->next;
+    free (fiber);
+  }
+#endif
+  free (threadpool);
+}
+
+void *
+threadpool_worker_local_data (void)
+{
+  return Worker_context.local_data;
+}
+
+void *
+threadpool_global_data (void)
+{
+  if (Worker_context.threadpool)
+    return Worker_context.threadpool->global_data;
+  else
+    return 0;
+}
+
+// Cancels a pending element, found in the local deque of 'owner' if not null.
+// The element is unlinked from its queue and moved to the canceled elements, to be completed by a worker without being processed.
+// Called with threadpool->mutex locked.
+static void
+threadpool_cancel_elem (struct threadpool *threadpool, struct elem *elem, struct worker *owner)
+{
+  elem->task.work = 0;          // The job won't be processed by thread_worker_runner.
+  if (owner)
+  {
+    thrd_honored (mtx_lock (&owner->mutex));    // Local deques are modified by their owners without locking threadpool->mutex.
+    elem_unlink (&owner->top, &owner->bottom, elem);
+    owner->nb_elems--;
+    thrd_honored (mtx_unlock (&owner->mutex));
+    threadpool->nb_queued_elems--;
+  }
+  else if (elem->queue && elem->queue != &threadpool->blocked)
+    threadpool_queue_unlink (threadpool, elem);
+  else                          // Elements of the submission ring can not be unlinked, and blocked tasks are referenced by their predecessors:
+    return;                     // they are completed once dequeued (or released).
+  elem_push (&threadpool->canceled.in, &threadpool->canceled.out, elem);
+  threadpool->canceled.nb_elems++;
+  threadpool->nb_queued_elems++;
+}
+
+// Completes all the canceled elements at once: 'job_delete' is called with TP_JOB_CANCELED, and the elements are released.
+// Called with threadpool->mutex locked, by a worker of the thread pool (the worker context is available in 'job_delete').
+static void
+threadpool_complete_canceled (struct threadpool *threadpool)
+{
+  struct elem *elem = threadpool->canceled.out;
+  threadpool->canceled.in = threadpool->canceled.out = 0;       // Detached first: 'job_delete' could itself cancel tasks.
+  threadpool->nb_queued_elems -= threadpool->canceled.nb_elems;
+  threadpool->canceled.nb_elems = 0;
+  for (struct elem * next; elem; elem = next)
+  {
+    next = elem->next;
+    tp_result_t ret = TP_JOB_CANCELED;
+    if (elem->task.job.data_delete)     // Call to task.job.data_delete is MT-safe (guarded by threadpool->mutex)
+      ret = elem->task.job.data_delete (elem->task.job.data, ret);
+    if (elem->task.future)
+      threadpool_future_complete (threadpool, elem->task.future, ret);
+    if (elem->task.parent)
+      threadpool_child_complete (threadpool, &elem->task);
+    threadpool_elem_free (threadpool, elem);
+  }
+  if (threadpool->nb_idle_waiters && threadpool_is_idle_predicate (threadpool))
+    threadpool_signal_idle (threadpool);
+}
+
+// Returns the pending element of task 'task_id' which is not indexed, i.e. in the submission ring or in a local deque (of '*owner').
+// Called with threadpool->mutex locked.
+static struct elem *
+threadpool_find_unindexed_task (struct threadpool *threadpool, size_t task_id, struct worker **owner)
+{
+  struct elem *elem = 0;
+  if (threadpool->ring.cell)    // Elements of the submission ring are published in submission order and can only be popped while threadpool->mutex is locked.
+    for (size_t pos = threadpool->ring.dequeue_pos; threadpool->ring.cell[pos & threadpool->ring.mask].sequence == pos + 1; pos++)
+      if ((elem = threadpool->ring.cell[pos & threadpool->ring.mask].elem)->task.id == task_id && elem->task.work)
+        return elem;
+  for (size_t i = 0; i < threadpool->nb_used_slots; i++)
+    if (threadpool->worker[i].nb_elems)
+    {
+      // Elements of local deques can only be popped while threadpool->mutex is locked: once found, the element stays in the deque.
+      thrd_honored (mtx_lock (&threadpool->worker[i].mutex));
+      for (elem = threadpool->worker[i].bottom; elem && !(elem->task.id == task_id && elem->task.work); elem = elem->next)
+        /* nothing */ ;
+      thrd_honored (mtx_unlock (&threadpool->worker[i].mutex));
+      if (elem)
+      {
+        *owner = &threadpool->worker[i];
+        return elem;
+      }
+    }
+  return 0;
+}
+
+// Indicates if 'elem' is pending and was submitted before (or after if 'last') 'candidate'.
+static int
+elem_is_candidate (const struct elem *elem, const struct elem *candidate, int last)
+{
+  return elem->task.work && (!candidate || (last ? elem->task.id > candidate->task.id : elem->task.id < candidate->task.id));
+}
+
+// Selects the first (or the last if 'last') pending task in submission order, found in the local deque of '*owner' if not null.
+// Tasks are queued in submission order in the FIFOs, in the blocked tasks, in the submission ring and in the local deques: only the ends of the queues are checked.
+// Tasks with a deadline are sorted by deadline though: they are all checked.
+// Called with threadpool->mutex locked.
+static struct elem *
+threadpool_select_queued_task (struct threadpool *threadpool, int last, struct worker **owner)
+{
+  struct elem *candidate = 0;
+  struct queue *queues[TP_NB_PRIORITY_LEVELS + 1];
+  for (size_t level = 0; level < TP_NB_PRIORITY_LEVELS; level++)
+    queues[level] = &threadpool->fifo[level];
+  queues[TP_NB_PRIORITY_LEVELS] = &threadpool->blocked;
+  for (size_t i = 0; i < sizeof (queues) / sizeof (*queues); i++)
+    for (struct elem * elem = last ? queues[i]->in : queues[i]->out; elem; elem = last ? elem->prev : elem->next)
+      if (elem->task.work)      // Canceled elements (not yet completed) are skipped.
+      {
+        if (elem_is_candidate (elem, candidate, last))
+          candidate = elem;
+        break;
+      }
+  for (struct elem * elem = threadpool->deadlines.out; elem; elem = elem->next)
+    if (elem_is_candidate (elem, candidate, last))
+      candidate = elem;
+  if (threadpool->ring.cell)
+    for (size_t pos = threadpool->ring.dequeue_pos; threadpool->ring.cell[pos & threadpool->ring.mask].sequence == pos + 1; pos++)
+      if (elem_is_candidate (threadpool->ring.cell[pos & threadpool->ring.mask].elem, candidate, last))
+        candidate = threadpool->ring.cell[pos & threadpool->ring.mask].elem;
+  *owner = 0;
+  for (size_t i = 0; i < threadpool->nb_used_slots; i++)
+    if (threadpool->worker[i].nb_elems)
+    {
+      thrd_honored (mtx_lock (&threadpool->worker[i].mutex));
+      for (struct elem * elem = last ? threadpool->worker[i].top : threadpool->worker[i].bottom; elem; elem = last ? elem->prev : elem->next)
+        if (elem->task.work)
+        {
+          if (elem_is_candidate (elem, candidate, last))
+          {
+            candidate = elem;
+            *owner = &threadpool->worker[i];
+          }
+          break;
+        }
+      thrd_honored (mtx_unlock (&threadpool->worker[i].mutex));
+    }
+  return candidate;
+}
+
+// Cancels all the pending tasks, and returns the number of cancelled tasks. Called with threadpool->mutex locked.
+static size_t
+threadpool_cancel_all_queued_tasks (struct threadpool *threadpool)
+{
+  size_t ret = 0;
+  struct queue *queues[TP_NB_PRIORITY_LEVELS + 1];
+  for (size_t level = 0; level < TP_NB_PRIORITY_LEVELS; level++)
+    queues[level] = &threadpool->fifo[level];
+  queues[TP_NB_PRIORITY_LEVELS] = &threadpool->deadlines;
+  for (size_t i = 0; i < sizeof (queues) / sizeof (*queues); i++)
+    for (struct elem * elem; (elem = queues[i]->out); threadpool_cancel_elem (threadpool, elem, 0))
+      ret += elem->task.work != 0;
+  for (struct elem * elem = threadpool->blocked.out; elem; elem = elem->next)
+    if (elem->task.work)        // Canceled blocked tasks are completed once their predecessors are.
+    {
+      elem->task.work = 0;
+      ret++;
+    }
+  if (threadpool->ring.cell)
+    for (size_t pos = threadpool->ring.dequeue_pos; threadpool->ring.cell[pos & threadpool->ring.mask].sequence == pos + 1; pos++)
+    {
+      struct elem *elem = threadpool->ring.cell[pos & threadpool->ring.mask].elem;
+      if (elem->task.work)
+      {
+        elem->task.work = 0;
+        ret++;
+      }
+    }
+  for (size_t i = 0; i < threadpool->nb_used_slots; i++)
+    if (threadpool->worker[i].nb_elems)
+    {
+      // The whole local deque is moved to the canceled elements (the number of queued elements is unchanged).
+      thrd_honored (mtx_lock (&threadpool->worker[i].mutex));
+      struct elem *bottom = threadpool->worker[i].bottom, *top = threadpool->worker[i].top;
+      size_t nb_elems = threadpool->worker[i].nb_elems;
+      threadpool->worker[i].bottom = threadpool->worker[i].top = 0;
+      threadpool->worker[i].nb_elems = 0;
+      thrd_honored (mtx_unlock (&threadpool->worker[i].mutex));
+      if (!bottom)
+        continue;
+      for (struct elem * elem = bottom; elem; elem = elem->next)
+        if (elem->task.work)
+        {
+          elem->task.work = 0;
+          ret++;
+        }
+      if ((bottom->prev = threadpool->canceled.in))
+        threadpool->canceled.in->next = bottom;
+      else
+        threadpool->canceled.out = bottom;
+      threadpool->canceled.in = top;
+      threadpool->canceled.nb_elems += nb_elems;
+    }
+  return ret;
+}
+
+// Asks the running task 'task_id' to stop, and returns the number of such tasks (0 or 1). Called with threadpool->mutex locked.
+// A sleeping task (see threadpool_task_sleep) is woken up at once.
+static size_t
+threadpool_cancel_running_task (struct threadpool *threadpool, size_t task_id)
+{
+  for (struct elem * elem = threadpool->running.out; elem; elem = elem->next)       // At most one per worker: not worth indexing.
+    if (elem->task.id == task_id && !elem->task.cancel_requested)
+    {
+      elem->task.cancel_requested = 1;
+      return 1;
+    }
+  for (struct elem * elem = threadpool->fibers.resumed.out; elem; elem = elem->next)
+    if (elem->task.id == task_id && !elem->task.cancel_requested)
+    {
+      elem->task.cancel_requested = 1;
+      return 1;
+    }
+  for (struct elem * elem = threadpool->fibers.sleeping.out; elem; elem = elem->next)
+    if (elem->task.id == task_id && !elem->task.cancel_requested)
+    {
+      elem->task.cancel_requested = 1;
+      elem_unlink (&threadpool->fibers.sleeping.in, &threadpool->fibers.sleeping.out, elem);
+      threadpool->fibers.sleeping.nb_elems--;
+      elem_push (&threadpool->fibers.resumed.in, &threadpool->fibers.resumed.out, elem);
+      threadpool->fibers.resumed.nb_elems++;
+      threadpool->nb_queued_elems++;
+      threadpool_wake_up_or_start_worker (threadpool);
+      return 1;
+    }
+  return 0;
+}
+
+size_t
+threadpool_cancel_task (struct threadpool *threadpool, size_t task_id)
+{
+  size_t ret = 0;
+  // N.B.: elements are only dequeued and their work is only modified while threadpool->mutex is locked.
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  size_t nb_canceled_elems = threadpool->canceled.nb_elems;
+  size_t nb_running = 0;        // Running tasks asked to stop, not counted as canceled (unless their work returns TP_JOB_CANCELED).
+  if (task_id == TP_CANCEL_ALL_PENDING_TASKS)
+    ret = threadpool_cancel_all_queued_tasks (threadpool);
+  else
+  {
+    struct worker *owner = 0;
+    struct elem *elem;
+    if (task_id == TP_CANCEL_NEXT_PENDING_TASK || task_id == TP_CANCEL_LAST_PENDING_TASK)
+      elem = threadpool_select_queued_task (threadpool, task_id == TP_CANCEL_LAST_PENDING_TASK, &owner);
+    else if (!(elem = threadpool_index_find (threadpool, task_id)))     // O(1) for the tasks in the FIFOs, with a deadline or blocked.
+      elem = threadpool_find_unindexed_task (threadpool, task_id, &owner);
+    if (elem)
+    {
+      threadpool_cancel_elem (threadpool, elem, owner);
+      ret = 1;
+    }
+    else if (task_id != TP_CANCEL_NEXT_PENDING_TASK && task_id != TP_CANCEL_LAST_PENDING_TASK)
+      nb_running = threadpool_cancel_running_task (threadpool, task_id);        // Not pending anymore: still running, maybe.
+  }
+  // Monitor immediately (without waiting for the task to be processed).
+  threadpool_pending_tasks_done (threadpool, ret);
+  threadpool->nb_canceled_tasks += ret;
+  if (threadpool->canceled.nb_elems > nb_canceled_elems)
+  {
+    if (Worker_context.worker && Worker_context.worker->threadpool == threadpool)
+      threadpool_complete_canceled (threadpool);
+    else                        // 'job_delete' is called by a worker, as for processed tasks.
+      threadpool_wake_up_or_start_worker (threadpool);
+  }
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  return ret + nb_running;
+}
+
+int
+threadpool_task_cancel_requested (void)
+{
+  struct threadpool *threadpool = Worker_context.threadpool;
+  if (!threadpool || !Worker_context.current_task)
+    return 0;                   // Not called from a task.
+  return Worker_context.current_task->cancel_requested || threadpool_is_short_circuited_predicate (threadpool);    // Lock-free.
+}
+
+// A task on a fiber can be suspended, and resumed by another thread, unless it has spawned children not synced yet, or it is in a blocking region or a guard.
+#define threadpool_task_can_suspend(task) ((task) && (task)->fiber && !(task)->spawned && !(Worker_context.worker && Worker_context.worker->blocking) && !Worker_context.nb_guards)
+
+void
+threadpool_task_sleep (double seconds)
+{
+  struct task *task = Worker_context.current_task;
+#ifdef __GLIBC__
+  if (threadpool_task_can_suspend (task))      // The frames of spawned children, the blocking region and the guard are kept by the thread: the task then sleeps on it.
+  {
+    task->fiber->wake_up = delay_to_abs_timespec (seconds > 0. ? seconds : 0.);        // from timers.h
+    threadpool_fiber_switch (task->fiber, FIBER_SLEEPING);
+    return;
+  }
+#endif
+  (void) task;
+  if (!(seconds > 0.))
+    return;
+  struct timespec delay = {.tv_sec = (time_t) seconds,.tv_nsec = (long) ((seconds - (double) (time_t) seconds) * 1e9) };
+  while (thrd_sleep (&delay, &delay) == -1);    // Interrupted by a signal: sleeps for the remaining time.
+}
+
+void
+threadpool_task_yield (void)
+{
+  struct task *task = Worker_context.current_task;
+#ifdef __GLIBC__
+  if (threadpool_task_can_suspend (task))
+  {
+    threadpool_fiber_switch (task->fiber, FIBER_YIELDED);
+    return;
+  }
+#endif
+  (void) task;
+  thrd_yield ();
+}
+
+void
+threadpool_blocking_begin (void)
+{
+  struct threadpool *threadpool = Worker_context.threadpool;
+  struct worker *worker = Worker_context.worker;
+  if (!worker || worker->blocking++)    // Not called by a worker, or in a nested blocking region.
+    return;
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  threadpool->nb_blocking_workers++;
+  if (threadpool_something_to_process_predicate (threadpool))   // A compensating worker is started (or an idle one woken up) at once, other ones as tasks are submitted.
+    threadpool_wake_up_or_start_worker (threadpool);
+  threadpool_monitor_call (threadpool, 0);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+void
+threadpool_blocking_end (void)
+{
+  struct threadpool *threadpool = Worker_context.threadpool;
+  struct worker *worker = Worker_context.worker;
+  if (!worker || !worker->blocking || --worker->blocking)
+    return;
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  assert (threadpool->nb_blocking_workers--);   // A surplus worker retires once it has completed its task (see thread_worker_runner).
+  if (threadpool->nb_alive_workers > threadpool_max_nb_alive_workers (threadpool))
+    threadpool_wake_up_parked_workers (threadpool, threadpool->nb_alive_workers - threadpool_max_nb_alive_workers (threadpool));
+  threadpool_monitor_call (threadpool, 0);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+// ================= Futures =================
+static const void *
+future_get_key (void *pa)
+{
+  const struct future *a = pa;
+  return &a->id;
+}
+
+static int
+future_cmp_key (const void *pa, const void *pb, const void *arg)
+{
+  (void) arg;
+  const size_t *a = pa;
+  const size_t *b = pb;
+  return *a > *b ? 1 : *a < *b ? -1 : 0;
+}
+
+static int
+future_get_operator (void *data, void *res, int *remove)
+{
+  (void) remove;
+  *(struct future **) res = data;
+  return 0;
+}
+
+static int
+future_reclaim_operator (void *data, void *res, int *remove)
+{
+  struct future *future = data;
+  *(struct future *) res = *future;
+  if (future->done)             // The completion record is reclaimed once the result has been retrieved.
+  {
+    if (future->nb_waiters)
+      future->reclaimed = 1;
+    else
+      free (future);
+    *remove = 1;
+  }
+  return 0;
+}
+
+void
+threadpool_set_task_futures (struct threadpool *threadpool, int enable)
+{
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  if (threadpool->nb_created_tasks)
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Operation not permitted."));
+    errno = EPERM;
+  }
+  else if (enable && !threadpool->futures.map && !(threadpool->futures.map = map_create (future_get_key, future_cmp_key, 0, 1)))
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Out of memory."));
+    errno = ENOMEM;
+  }
+  else if (!enable && threadpool->futures.map)
+  {
+    map_destroy (threadpool->futures.map);
+    threadpool->futures.map = 0;
+  }
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+int
+threadpool_task_wait (struct threadpool *threadpool, tp_task_t task_id, double timeout)
+{
+  struct future *future = 0;
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  if (!threadpool->futures.map || !map_find_key (threadpool->futures.map, &task_id, future_get_operator, &future, 0, 0))
+  {
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+    errno = EINVAL;
+    return 0;
+  }
+  struct timespec abs_timeout = delay_to_abs_timespec (timeout > 0 ? timeout : 0);     // from timers.h
+  struct worker *worker = Worker_context.worker;
+  struct worker_context saved;
+  struct worker *borrowed = 0;
+  if (worker && worker->threadpool != threadpool)       // Worker of another thread pool (nested thread pools):
+    worker = borrowed = threadpool_worker_borrow (threadpool, &saved);  // it helps rather than block if a slot is free.
+  future->nb_waiters++;         // The completion record can not be reclaimed (by threadpool_task_result) in the meantime.
+  int ret = thrd_success;
+  while (!future->done && ret != thrd_timedout)
+  {
+    struct elem *elem;
+    if (worker && threadpool_something_to_process_predicate (threadpool) && (elem = threadpool_next_elem (threadpool)))
+      threadpool_process_elem (threadpool, elem);       // A worker does not block: it processes other tasks while it waits.
+    else if (worker)            // Nothing to process: the worker parks until the task is completed or a new task is submitted.
+    {
+      worker->waited_future = future;
+      threadpool->nb_idle_workers++;
+      ret = threadpool_worker_park (threadpool, worker, timeout >= 0 ? &abs_timeout : 0);
+      if (worker->parked)       // Spurious wake-up.
+        threadpool_worker_unpark (threadpool, worker);
+      assert (threadpool->nb_idle_workers--);
+      worker->waited_future = 0;
+    }
+    else
+      ret = timeout >= 0 ? cnd_timedwait (&threadpool->futures.completed, &threadpool->mutex, &abs_timeout) :
+        cnd_wait (&threadpool->futures.completed, &threadpool->mutex);
+    thrd_honored (ret);
+  }
+  int done = future->done;
+  if (!--future->nb_waiters && future->reclaimed)
+    free (future);
+  if (borrowed)
+    threadpool_worker_leave (threadpool, borrowed, &saved);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  if (!done)
+    errno = ETIMEDOUT;
+  return done;
+}
+
+int
+threadpool_task_detach (struct threadpool *threadpool, tp_task_t task_id)
+{
+  struct future *future = 0, reclaimed;
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  int found = threadpool->futures.map && map_find_key (threadpool->futures.map, &task_id, future_get_operator, &future, 0, 0);
+  if (found && future->done)    // Already completed: reclaimed at once.
+    map_find_key (threadpool->futures.map, &task_id, future_reclaim_operator, &reclaimed, 0, 0);
+  else if (found)
+    future->detached = 1;
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  if (!found)
+    errno = EINVAL;
+  return found;
+}
+
+tp_result_t
+threadpool_task_result (struct threadpool *threadpool, tp_task_t task_id)
+{
+  struct future future = {.done = 0 };
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  int found = threadpool->futures.map && map_find_key (threadpool->futures.map, &task_id, future_reclaim_operator, &future, 0, 0);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  if (!found)
+    errno = EINVAL;
+  else if (!future.done)
+    errno = EBUSY;
+  return future.done ? future.result : TP_JOB_FAILURE;
+}
+
+size_t
+threadpool_add_task_after (struct threadpool *threadpool, tp_result_t (*work) (void *job), void *job, tp_result_t (*job_delete) (void *job, tp_result_t result),
+                           size_t nb_predecessors, const tp_task_t predecessors[])
+{
+  call_once (&I18N_INIT, threadpool_i18n_init);
+  if (!threadpool->futures.map)
+  {
+    fprintf (stderr, "%s: %s\n", __func__, _("Operation not permitted."));
+    errno = EPERM;
+    return 0;
+  }
+  if (threadpool_throttle (threadpool, 1) == TP_BACKPRESSURE_FAIL)      // A task with predecessors is never run inline: it is submitted anyway.
+  {
+    errno = EAGAIN;
+    return 0;
+  }
+  struct elem *new_elem = threadpool_elem_alloc (threadpool);   // Allocated before locking.
+  struct future *future = new_elem ? malloc (sizeof (*future)) : 0;
+  struct successor *successors = 0;
+  for (size_t i = 0; future && i < nb_predecessors; i++)
+  {
+    struct successor *successor = malloc (sizeof (*successor));
+    if (!successor)
+    {
+      free (future);
+      future = 0;
+      break;
+    }
+    successor->elem = new_elem;
+    successor->next = successors;
+    successors = successor;
+  }
+  if (!future)
+  {
+    for (struct successor * successor; (successor = successors); free (successor))
+      successors = successor->next;
+    if (new_elem)
+      threadpool_elem_free (threadpool, new_elem);
+    fprintf (stderr, "%s: %s\n", __func__, _("Out of memory."));
+    errno = ENOMEM;
+    return 0;
+  }
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  struct future *predecessor = 0;
+  for (size_t i = 0; i < nb_predecessors; i++)
+    if (!map_find_key (threadpool->futures.map, &predecessors[i], future_get_operator, &predecessor, 0, 0))
+    {
+      thrd_honored (mtx_unlock (&threadpool->mutex));
+      for (struct successor * successor; (successor = successors); free (successor))
+        successors = successor->next;
+      free (future);
+      threadpool_elem_free (threadpool, new_elem);
+      fprintf (stderr, "%s: %s\n", __func__, _("Invalid argument."));
+      errno = EINVAL;
+      return 0;
+    }
+  threadpool_init_task (threadpool, new_elem, threadpool_new_task_id (threadpool), work, job, job_delete, 0, future);
+  size_t id = new_elem->task.id;
+  for (size_t i = 0; i < nb_predecessors; i++)
+  {
+    struct successor *successor = successors;
+    successors = successor->next;
+    map_find_key (threadpool->futures.map, &predecessors[i], future_get_operator, &predecessor, 0, 0);
+    if (predecessor->done)      // Already completed.
+    {
+      threadpool_task_predecessor_done (threadpool, &new_elem->task, predecessor->result);
+      free (successor);
+    }
+    else                        // The task will be queued by the worker which completes its last predecessor (see threadpool_future_complete).
+    {
+      successor->next = predecessor->successors;
+      predecessor->successors = successor;
+      new_elem->task.nb_predecessors++;
+    }
+  }
+  if (new_elem->task.nb_predecessors)
+  {
+    threadpool_queue_push (threadpool, &threadpool->blocked, new_elem);
+  }
+  else
+  {
+    if (new_elem->task.work && new_elem->task.predecessor_failed)
+    {
+      new_elem->task.work = 0;  // The job won't be processed by thread_worker_runner.
+      threadpool_pending_tasks_done (threadpool, 1);
+      threadpool->nb_canceled_tasks++;
+    }
+    threadpool_fifo_push (threadpool, 0, new_elem);
+    threadpool_wake_up_or_start_worker (threadpool);
+  }
+  threadpool_monitor_call (threadpool, 0);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  return id;
+}
+
+// ================= Fork-join =================
+// A task spawns children which are pushed to the local deque of its worker, and waits for them with threadpool_sync.
+// Their jobs are copied in frames allocated on a stack of the worker rather than on the heap: frames are released all at once by threadpool_sync,
+// which is called implicitly at the end of the task (a task is not completed before its children).
+// The order of frames is preserved, since a task waiting for its children only processes other tasks, which sync before they return, in the meantime.
+
+// Returns the top of the stack of frames of the worker.
+static void *
+threadpool_frame_top (struct worker *worker)
+{
+  return worker->frames ? worker->frames->data + worker->frames->top : 0;
+}
+
+// Allocates a frame of 'size' bytes on the stack of frames of the worker. Returns 0 if out of memory.
+static void *
+threadpool_frame_push (struct worker *worker, size_t size)
+{
+  size_t nb_units = (size + sizeof (max_align_t) - 1) / sizeof (max_align_t);
+  struct frame_chunk *chunk = worker->frames;
+  if (!chunk || chunk->top + nb_units > chunk->size)
+  {
+    if (worker->spare_frames && worker->spare_frames->size >= nb_units)
+    {
+      chunk = worker->spare_frames;
+      worker->spare_frames = 0;
+    }
+    else
+    {
+      size_t nb = nb_units > FRAME_CHUNK_NB_UNITS ? nb_units : FRAME_CHUNK_NB_UNITS;
+      if (!(chunk = malloc (sizeof (*chunk) + nb * sizeof (*chunk->data))))
+        return 0;
+      chunk->size = nb;
+    }
+    chunk->prev = worker->frames;
+    chunk->top = 0;
+    worker->frames = chunk;
+  }
+  void *frame = chunk->data + chunk->top;
+  chunk->top += nb_units;
+  return frame;
+}
+
+// Releases the frames allocated on the stack of frames of the worker above 'top' (as returned by threadpool_frame_top).
+static void
+threadpool_frame_pop (struct worker *worker, void *top)
+{
+  for (struct frame_chunk * chunk; (chunk = worker->frames) && !((max_align_t *) top >= chunk->data && (max_align_t *) top <= chunk->data + chunk->top);)
+  {
+    worker->frames = chunk->prev;
+    if (!worker->spare_frames)  // The last released chunk is kept for reuse.
+      worker->spare_frames = chunk;
+    else
+      free (chunk);
+  }
+  if (worker->frames)
+    worker->frames->top = (size_t) ((max_align_t *) top - worker->frames->data);
+}
+
+// A spawned child is completed. Called with threadpool->mutex locked.
+static void
+threadpool_child_complete (struct threadpool *threadpool, struct task *task)
+{
+  struct task *parent = task->parent;
+  if (--parent->nb_children)
+    return;
+  for (struct worker * worker = threadpool->parked, *next; worker; worker = next)
+  {
+    next = worker->parked_next;
+    if (worker->syncing == parent)      // The parent waits for its children (in threadpool_sync).
+    {
+      threadpool_worker_unpark (threadpool, worker);
+      thrd_honored (cnd_signal (&worker->wake_up));
+    }
+  }
+}
+
+// Waits for the spawned children of the running task 'task' to be completed, and releases their frames.
+// The worker processes other tasks (its children first, from its local deque) while it waits rather than blocking. Called with threadpool->mutex locked.
+static void
+threadpool_task_sync (struct threadpool *threadpool, struct task *task)
+{
+  struct worker *worker = Worker_context.worker;
+  while (task->nb_children)
+  {
+    struct elem *elem;
+    if (threadpool_something_to_process_predicate (threadpool) && (elem = threadpool_next_elem (threadpool)))
+      threadpool_process_elem (threadpool, elem);
+    else                        // Nothing to process: the worker parks until its children are completed (by thieves) or a new task is submitted.
+    {
+      worker->syncing = task;
+      threadpool->nb_idle_workers++;
+      thrd_honored (threadpool_worker_park (threadpool, worker, 0));
+      if (worker->parked)       // Spurious wake-up.
+        threadpool_worker_unpark (threadpool, worker);
+      assert (threadpool->nb_idle_workers--);
+      worker->syncing = 0;
+    }
+  }
+  threadpool_frame_pop (worker, task->frames);
+  task->spawned = 0;
+}
+
+tp_task_t
+threadpool_spawn (tp_result_t (*work) (void *job), void *job, size_t size)
+{
+  struct task *parent = Worker_context.current_task;
+  struct worker *worker = Worker_context.worker;
+  if (!parent || !worker)       // Not called from inside a task processed by a worker.
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Operation not permitted."));
+    errno = EPERM;
+    return 0;
+  }
+  if (!parent->spawned)
+  {
+    parent->frames = threadpool_frame_top (worker);
+    parent->spawned = 1;
+  }
+  if (size)
+  {
+    void *frame = threadpool_frame_push (worker, size);
+    if (!frame)
+    {
+      call_once (&I18N_INIT, threadpool_i18n_init);
+      fprintf (stderr, "%s: %s\n", __func__, _("Out of memory."));
+      errno = ENOMEM;
+      return 0;
+    }
+    job = memcpy (frame, job, size);
+  }
+  return threadpool_create_task (Worker_context.threadpool, work, job, 0, 0, 0, 0, parent);
+}
+
+void
+threadpool_sync (void)
+{
+  struct task *task = Worker_context.current_task;
+  if (!task)                    // Not called from inside a task.
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Operation not permitted."));
+    errno = EPERM;
+    return;
+  }
+  if (!task->spawned)
+    return;
+  struct threadpool *threadpool = Worker_context.threadpool;
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  threadpool_task_sync (threadpool, task);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+// ================= Parallel loops =================
+// Lazy binary splitting: the range of a loop is split in halves only when some worker is idle, and processed by chunks of 'grain' iterations otherwise.
+// The second half is submitted as a task (processed the same way), the first half is kept by the splitter.
+
+struct parallel_for             // Loop shared by the ranges it is split into (on the stack of the caller of threadpool_parallel_for).
+{
+  struct threadpool *threadpool;
+  void (*body) (size_t begin, size_t end, void *arg);
+  void *arg;
+  size_t grain;
+  size_t nb_remaining;          // Number of iterations not processed (nor canceled) yet. Guarded by threadpool->mutex.
+  size_t nb_canceled;           // Number of iterations of canceled ranges.
+  struct worker *waiter;        // Worker of the thread pool waiting for the loop to be completed (0 if the caller is not a worker of the thread pool).
+  cnd_t completed;              // Signalled when the loop is completed, if waited for by a thread other than a worker of the thread pool.
+};
+
+struct parallel_for_range       // Job of a task processing a range of a loop.
+{
+  struct parallel_for *loop;
+  size_t begin, end;
+};
+
+// Indicates that a range should rather be split: some worker is idle (or could be started), and not already due to process a queued task.
+static int
+threadpool_parallel_for_should_split (struct threadpool *threadpool)
+{
+  return threadpool->property == TP_RUN_ALL_TASKS       // Other properties would short-circuit on the result of the tasks of the loop.
+    && threadpool->nb_idle_workers + (threadpool->nb_alive_workers < threadpool_max_nb_alive_workers (threadpool) ?
+                                      threadpool_max_nb_alive_workers (threadpool) - threadpool->nb_alive_workers : 0) > threadpool->nb_queued_elems;     // Lock-free heuristic.
+}
+
+static tp_result_t threadpool_parallel_for_worker (void *job);
+static tp_result_t threadpool_parallel_for_job_delete (void *job, tp_result_t result);
+
+// Processes the range [*begin, *end) of a loop, splitting it lazily. '*end' is updated when the range is split.
+static void
+threadpool_parallel_for_run (struct parallel_for *loop, size_t *begin, size_t *end)
+{
+  for (size_t b = *begin; b < *end;)
+    if (*end - b > loop->grain && threadpool_parallel_for_should_split (loop->threadpool))
+    {
+      struct parallel_for_range *range = malloc (sizeof (*range));
+      size_t middle = b + (*end - b) / 2;
+      if (range)
+        *range = (struct parallel_for_range) {.loop = loop,.begin = middle,.end = *end };
+      if (range && threadpool_add_task (loop->threadpool, threadpool_parallel_for_worker, range, threadpool_parallel_for_job_delete))
+        *end = middle;
+      else                      // The range is processed on the spot if memory is short.
+      {
+        free (range);
+        loop->body (b, *end, loop->arg);
+        b = *end;
+      }
+    }
+    else
+    {
+      size_t chunk = *end - b > loop->grain ? loop->grain : *end - b;
+      loop->body (b, b + chunk, loop->arg);
+      b += chunk;
+    }
+}
+
+// Accounts for 'nb' processed (or canceled) iterations of a loop, and signals its caller once all iterations are processed.
+// Called with threadpool->mutex locked.
+static void
+threadpool_parallel_for_done (struct parallel_for *loop, size_t nb)
+{
+  if ((loop->nb_remaining -= nb))
+    return;
+  if (!loop->waiter)
+    thrd_honored (cnd_broadcast (&loop->completed));
+  else if (loop->waiter->parked)
+  {
+    threadpool_worker_unpark (loop->threadpool, loop->waiter);
+    thrd_honored (cnd_signal (&loop->waiter->wake_up));
+  }
+}
+
+static tp_result_t
+threadpool_parallel_for_worker (void *job)
+{
+  struct parallel_for_range *range = job;
+  threadpool_parallel_for_run (range->loop, &range->begin, &range->end);
+  return TP_JOB_SUCCESS;
+}
+
+static tp_result_t
+threadpool_parallel_for_job_delete (void *job, tp_result_t result)
+{
+  struct parallel_for_range *range = job;
+  if (result == TP_JOB_CANCELED)
+    range->loop->nb_canceled += range->end - range->begin;
+  threadpool_parallel_for_done (range->loop, range->end - range->begin);        // Called with threadpool->mutex locked.
+  free (range);
+  return result;
+}
+
+size_t
+threadpool_parallel_for (struct threadpool *threadpool, size_t begin, size_t end, size_t grain, void (*body) (size_t begin, size_t end, void *arg), void *arg)
+{
+  if (begin >= end)
+    return 0;
+  struct parallel_for loop = {.threadpool = threadpool,.body = body,.arg = arg,.grain = grain ? grain : 1,.nb_remaining = end - begin,
+    .nb_canceled = 0,.waiter = Worker_context.worker && Worker_context.worker->threadpool == threadpool ? Worker_context.worker : 0
+  };
+  if (!loop.waiter)
+    thrd_honored (cnd_init (&loop.completed));
+  size_t b = begin, e = end;
+  threadpool_parallel_for_run (&loop, &b, &e);  // The caller takes part in the loop.
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  struct worker_context saved;
+  struct worker *borrowed = 0;
+  if (!loop.waiter && threadpool_is_foreign_worker (threadpool))       // Worker of another thread pool (nested thread pools):
+    loop.waiter = borrowed = threadpool_worker_borrow (threadpool, &saved);     // it helps rather than block if a slot is free.
+  threadpool_parallel_for_done (&loop, e - begin);
+  while (loop.nb_remaining)
+  {
+    struct elem *elem;
+    if (loop.waiter && threadpool_something_to_process_predicate (threadpool) && (elem = threadpool_next_elem (threadpool)))
+      threadpool_process_elem (threadpool, elem);       // A worker does not block: it processes other tasks (of the loop or not) while it waits.
+    else if (loop.waiter)       // Nothing to process: the worker parks until the loop is completed or a new task is submitted.
+    {
+      threadpool->nb_idle_workers++;
+      thrd_honored (threadpool_worker_park (threadpool, loop.waiter, 0));
+      if (loop.waiter->parked)  // Spurious wake-up.
+        threadpool_worker_unpark (threadpool, loop.waiter);
+      assert (threadpool->nb_idle_workers--);
+    }
+    else
+      thrd_honored (cnd_wait (&loop.completed, &threadpool->mutex));
+  }
+  if (borrowed)
+    threadpool_worker_leave (threadpool, borrowed, &saved);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  if (!loop.waiter || borrowed)
+    cnd_destroy (&loop.completed);
+  return end - begin - loop.nb_canceled;
+}
+
+void
+threadpool_set_idle_timeout (struct threadpool *threadpool, double delay)
+{
+  static double inifinity = 120 * 24 * 3600 /* seconds */ ;     // 120 UTC days.
+  if (delay > inifinity)
+    delay = inifinity;
+  if (delay >= 0.)
+  {
+    thrd_honored (mtx_lock (&threadpool->mutex));
+    threadpool->idle_timeout = delay;
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+  }
+  else
+    errno = EINVAL;
+}
+
+void
+threadpool_set_idle_spin (struct threadpool *threadpool, double delay)
+{
+  static double max = 1 /* second */ ;
+  if (delay > max)
+    delay = max;
+  if (delay >= 0.)
+  {
+    thrd_honored (mtx_lock (&threadpool->mutex));
+    threadpool->idle_spin = delay;
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+  }
+  else
+    errno = EINVAL;
+}
+
+// Starts the registered workers, outside of threadpool->mutex, on behalf of the threads which have registered them.
+static int
+thread_worker_spawner (void *args)
+{
+  struct threadpool *threadpool = args;
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  while (1)
+  {
+    while (!threadpool->spawner.nb_workers && !threadpool->spawner.quit)
+      thrd_honored (cnd_wait (&threadpool->spawner.request, &threadpool->mutex));
+    if (!threadpool->spawner.nb_workers)
+      break;                    // Quit.
+    struct worker *worker = threadpool->spawner.workers;
+    threadpool->spawner.workers = worker->next_to_be_spawned;
+    threadpool->spawner.nb_workers--;
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+    int started = threadpool_worker_start (threadpool, worker) == thrd_success; // <<<<<<<<<< Outside of threadpool->mutex.
+    thrd_honored (mtx_lock (&threadpool->mutex));
+    if (!started)
+      threadpool_worker_unregister (threadpool, worker);
+  }
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+  return 0;
+}
+
+void
+threadpool_set_min_workers (struct threadpool *threadpool, size_t min_workers)
+{
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  if (threadpool->concluding)
+  {
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Operation not permitted."));
+    errno = EPERM;
+    return;
+  }
+  if (min_workers > threadpool->requested_nb_workers)
+    min_workers = threadpool->requested_nb_workers;
+  threadpool->min_workers = min_workers;
+  if (!threadpool->spawner.started && min_workers)
+    threadpool->spawner.started = thrd_create (&threadpool->spawner.id, thread_worker_spawner, threadpool) == thrd_success;
+  for (struct worker * worker; threadpool->nb_alive_workers < min_workers && (worker = threadpool_free_slot (threadpool))
+       && threadpool_worker_start (threadpool, worker) == thrd_success;)      // Warm workers are started at once.
+    threadpool_worker_register (threadpool, worker);
+  if (threadpool->min_workers)
+    threadpool_wake_up_parked_workers (threadpool, SIZE_MAX);   // Parked workers are parked again, without timeout if warm.
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+void
+threadpool_set_idle_retirement (struct threadpool *threadpool, size_t floor, double max_delay)
+{
+  if (max_delay < 0.)
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Invalid argument."));
+    errno = EINVAL;
+    return;
+  }
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  if (floor > threadpool->requested_nb_workers)
+    floor = threadpool->requested_nb_workers;
+  threadpool->retirement.floor = floor;
+  threadpool->retirement.max_delay = max_delay;
+  threadpool->retirement.nb = 0;
+  threadpool_wake_up_parked_workers (threadpool, SIZE_MAX);     // Parked workers are parked again, without timeout if warm.
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+void
+threadpool_set_adaptive_workers (struct threadpool *threadpool, size_t min_workers, size_t max_workers)
+{
+  if (max_workers && (!min_workers || min_workers > max_workers))
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Invalid argument."));
+    errno = EINVAL;
+    return;
+  }
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  if (threadpool->concluding)
+  {
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Operation not permitted."));
+    errno = EPERM;
+    return;
+  }
+  if (max_workers > threadpool->requested_nb_workers)
+    max_workers = threadpool->requested_nb_workers;
+  if (min_workers > max_workers)
+    min_workers = max_workers;
+  threadpool->controller.min = min_workers;
+  threadpool->controller.max = max_workers;
+  threadpool->controller.direction = -1;
+  threadpool->controller.throughput = 0.;
+  threadpool->controller.nb_completed = threadpool->nb_succeeded_tasks + threadpool->nb_failed_tasks + threadpool->nb_canceled_tasks;
+  timespec_get (&threadpool->controller.time, TIME_UTC);
+  size_t target = max_workers ? threadpool->nb_alive_workers : threadpool->requested_nb_workers;    // The controller starts from the current number of workers.
+  threadpool->target_nb_workers = !max_workers ? target : target < min_workers ? min_workers : target > max_workers ? max_workers : target;
+  if (threadpool->nb_alive_workers > threadpool_max_nb_alive_workers (threadpool))
+    threadpool_wake_up_parked_workers (threadpool, threadpool->nb_alive_workers - threadpool_max_nb_alive_workers (threadpool));
+  else if (threadpool_something_to_process_predicate (threadpool))
+    threadpool_wake_up_or_start_workers (threadpool, threadpool->nb_queued_elems);
+  threadpool_monitor_call (threadpool, 1);
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+void
+threadpool_set_max_pending (struct threadpool *threadpool, size_t max_pending, tp_backpressure_t policy)
+{
+  if (policy != TP_BACKPRESSURE_BLOCK && policy != TP_BACKPRESSURE_FAIL && policy != TP_BACKPRESSURE_RUN_INLINE)
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Invalid argument."));
+    errno = EINVAL;
+    return;
+  }
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  threadpool->backpressure.policy = policy;
+  threadpool->backpressure.max_pending = max_pending;
+  if (threadpool->backpressure.nb_waiters)
+    thrd_honored (cnd_broadcast (&threadpool->backpressure.not_full));  // Blocked producers check the new bound.
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+void
+threadpool_set_priority_aging (struct threadpool *threadpool, double delay)
+{
+  if (delay >= 0.)
+  {
+    thrd_honored (mtx_lock (&threadpool->mutex));
+    if (threadpool->priority_aging <= 0.)       // Tasks already queued are given a queueing time.
+    {
+      struct timespec now;
+      timespec_get (&now, TIME_UTC);
+      for (size_t level = 0; level < TP_NB_PRIORITY_LEVELS; level++)
+        for (struct elem * elem = threadpool->fifo[level].out; elem; elem = elem->next)
+          elem->time = now;
+    }
+    threadpool->priority_aging = delay;
+    thrd_honored (mtx_unlock (&threadpool->mutex));
+  }
+  else
+    errno = EINVAL;
+}
+
+void
+threadpool_set_lock_free_submission (struct threadpool *threadpool, size_t capacity)
+{
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  size_t size = 1;
+  while (size < capacity && size <= SIZE_MAX / 2)
+    size <<= 1;                 // Power of 2.
+  if (threadpool->nb_created_tasks || threadpool->ring.cell)
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Operation not permitted."));
+    errno = EPERM;
+  }
+  else if (capacity && !(threadpool->ring.cell = malloc (size * sizeof (*threadpool->ring.cell))))
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Out of memory."));
+    errno = ENOMEM;
+  }
+  else if (capacity)
+  {
+    for (size_t pos = 0; pos < size; pos++)
+      threadpool->ring.cell[pos].sequence = pos;
+    threadpool->ring.mask = size - 1;
+    threadpool->ring.enqueue_pos = threadpool->ring.dequeue_pos = 0;
+  }
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+#ifdef __GLIBC__
+void
+threadpool_set_cpu_affinity (struct threadpool *threadpool, tp_affinity_t affinity)
+{
+  call_once (&TOPOLOGY_INIT, topology_init);
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  if (threadpool->nb_created_tasks)
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Operation not permitted."));
+    errno = EPERM;
+  }
+  else if (affinity != TP_AFFINITY_NONE && affinity != TP_AFFINITY_ROUND_ROBIN && affinity != TP_AFFINITY_COMPACT && affinity != TP_AFFINITY_SCATTER)
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Invalid argument."));
+    errno = EINVAL;
+  }
+  else
+  {
+    if (!Topology.nb_cpus)
+      affinity = TP_AFFINITY_NONE;      // Unknown topology.
+    for (size_t i = 0; i < threadpool->nb_slots; i++)
+    {
+      int cpu = -1;
+      if (affinity == TP_AFFINITY_ROUND_ROBIN)  // Worker i on the i-th allowed CPU.
+        cpu = Topology.by_id[i % Topology.nb_cpus];
+      else if (affinity == TP_AFFINITY_COMPACT) // Workers fill the CPUs of a NUMA node before the next node.
+        cpu = Topology.by_node[i % Topology.nb_cpus];
+      else if (affinity == TP_AFFINITY_SCATTER) // Workers are spread over NUMA nodes.
+      {
+        size_t node = i % Topology.nb_nodes;
+        cpu = Topology.by_node[Topology.node_first[node] + (i / Topology.nb_nodes) % Topology.node_nb_cpus[node]];
+      }
+      threadpool->worker[i].cpu = cpu;
+      threadpool->worker[i].node = cpu >= 0 ? Topology.node[cpu] : 0;
+    }
+    threadpool->nb_numa_nodes = affinity == TP_AFFINITY_NONE ? 1 : Topology.nb_nodes;
+  }
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+void
+threadpool_set_worker_stack (struct threadpool *threadpool, size_t stack_size, size_t guard_size)
+{
+  if (stack_size && stack_size < (size_t) PTHREAD_STACK_MIN)
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Invalid argument."));
+    errno = EINVAL;
+    return;
+  }
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  threadpool->stack.size = stack_size;
+  threadpool->stack.guard_size = guard_size;
+  threadpool->stack.set = 1;
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+
+void
+threadpool_set_fibers (struct threadpool *threadpool, size_t stack_size)
+{
+  if (stack_size && stack_size < FIBER_MIN_STACK_SIZE)
+  {
+    call_once (&I18N_INIT, threadpool_i18n_init);
+    fprintf (stderr, "%s: %s\n", __func__, _("Invalid argument."));
+    errno = EINVAL;
+    return;
+  }
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  threadpool->fibers.stack_size = stack_size;
+  for (struct fiber * fiber; (fiber = threadpool->fibers.free);)       // Free fibers have the previous stack size (running ones are freed when done).
+  {
+    threadpool->fibers.free = fiber->next;
+    free (fiber);
+  }
+  threadpool->fibers.nb_free = 0;
+  thrd_honored (mtx_unlock (&threadpool->mutex));
+}
+#endif
+
+void
+threadpool_set_work_stealing (struct threadpool *threadpool, int enable)
+{
+  thrd_honored (mtx_lock (&threadpool->mutex));
+  threadpool->work_stealing = enable;
+  thrd_honored (mtx_unlock (&threadpool->mutex));
 }
 
 void
@@ -762,11 +3791,14 @@ threadpool_guard_begin (void)
 {
   if (Worker_context.threadpool && Worker_context.threadpool->requested_nb_workers > 1)
     thrd_honored (mtx_lock (&Worker_context.threadpool->mutex));
+  Worker_context.nb_guards++;
 }
 
 void
 threadpool_guard_end (void)
 {
+  if (Worker_context.nb_guards)
+    Worker_context.nb_guards--;
   if (Worker_context.threadpool && Worker_context.threadpool->requested_nb_workers > 1)
     thrd_honored (mtx_unlock (&Worker_context.threadpool->mutex));
 }
@@ -23,6 +23,10 @@ extern const tp_property_t TP_RUN_ALL_TASKS;    // Runs all submitted tasks.
 extern const tp_property_t TP_RUN_ALL_SUCCESSFUL_TASKS; // Runs submitted tasks until one fails. Cancel automatically other (already or to be) submitted tasks.
 extern const tp_property_t TP_RUN_ONE_SUCCESSFUL_TASK;  // Runs submitted tasks until one succeeds. Cancel automatically other (already or to be) submitted tasks.
 struct threadpool *threadpool_create_and_start (size_t nb_workers, void *global_data, tp_property_t property);
+typedef int tp_backpressure_t;
+extern const tp_backpressure_t TP_BACKPRESSURE_BLOCK;   // The producer waits until the number of pending tasks falls below the bound.
+extern const tp_backpressure_t TP_BACKPRESSURE_FAIL;    // The submission fails (returns 0) and errno is set to EAGAIN.
+extern const tp_backpressure_t TP_BACKPRESSURE_RUN_INLINE;      // The producer processes the task itself before the submission returns.
 size_t threadpool_nb_workers (struct threadpool *threadpool);
 
 // Returns the current thread pool.
@@ -52,6 +56,45 @@ extern const tp_result_t TP_JOB_CANCELED;
 typedef size_t tp_task_t;
 tp_task_t threadpool_add_task (struct threadpool *threadpool, tp_result_t (*work) (void *job), void *job, tp_result_t (*job_delete) (void *job, tp_result_t result));
 
+// Call to 'threadpool_add_tasks' is MT-safe.
+// Submits 'nb_tasks' tasks at once, one per job of the array 'jobs', all processed by 'work' (as if submitted one after the other by 'threadpool_add_task', but at a lower cost).
+// Returns 0 on error (and none of the tasks are submitted), the unique id of the first submitted task otherwise: the tasks are given contiguous ids,
+// from the returned value for jobs[0] to the returned value + nb_tasks - 1 for jobs[nb_tasks - 1].
+// Set errno to ENOMEM on error (out of memory).
+tp_task_t threadpool_add_tasks (struct threadpool *threadpool, size_t nb_tasks, tp_result_t (*work) (void *job), void *jobs[],
+                                tp_result_t (*job_delete) (void *job, tp_result_t result));
+
+// Call to 'threadpool_add_task_with_priority' is MT-safe.
+// Submits a task as 'threadpool_add_task' does, with a priority in [0, TP_NB_PRIORITY_LEVELS - 1].
+// Pending tasks of higher priority are processed first. Tasks submitted by 'threadpool_add_task' have the lowest priority 0.
+// Pending tasks with a deadline (see 'threadpool_add_task_with_deadline') take precedence over all the priority levels.
+// Returns 0 on error, a unique id of the submitted task otherwise.
+// Set errno to ENOMEM on error (out of memory), to EINVAL if 'priority' is out of range.
+#  define TP_NB_PRIORITY_LEVELS 4
+tp_task_t threadpool_add_task_with_priority (struct threadpool *threadpool, size_t priority, tp_result_t (*work) (void *job), void *job,
+                                             tp_result_t (*job_delete) (void *job, tp_result_t result));
+
+// Call to 'threadpool_add_task_with_deadline' is MT-safe.
+// Submits a task as 'threadpool_add_task' does, with a deadline 'delay' seconds from now.
+// Pending tasks with a deadline are processed first, earliest deadline first, before any other pending task, even of higher priority (see 'threadpool_add_task_with_priority'):
+// a steady stream of tasks with a deadline delays the prioritised tasks for as long as it lasts (priority aging does not apply).
+// A task still pending at its deadline is not processed: it is canceled ('job_delete' is called with TP_JOB_CANCELED) and counted as expired.
+// Returns 0 on error, a unique id of the submitted task otherwise.
+// Set errno to ENOMEM on error (out of memory), to EINVAL if 'delay' is negative.
+tp_task_t threadpool_add_task_with_deadline (struct threadpool *threadpool, double delay, tp_result_t (*work) (void *job), void *job,
+                                             tp_result_t (*job_delete) (void *job, tp_result_t result));
+
+// 'threadpool_spawn' should be called from inside a task. It submits a child task of the running task to the threadpool, pushed to the local deque of the worker.
+// If 'size' is not 0, the 'size' bytes of 'job' are copied in a frame allocated on a stack of the worker (rather than on the heap), and the copy is passed to 'work'.
+// Frames are released when the running task calls 'threadpool_sync'.
+// Returns 0 on error, a unique id of the submitted task otherwise.
+// Set errno to ENOMEM on error (out of memory), to EPERM if not called from inside a task.
+tp_task_t threadpool_spawn (tp_result_t (*work) (void *job), void *job, size_t size);
+// 'threadpool_sync' waits for the children spawned by the running task to be completed. The worker processes other tasks (its children first) while it waits rather than blocking.
+// A task which has spawned children is not completed before them: 'threadpool_sync' is called implicitly when 'work' returns.
+// Set errno to EPERM if not called from inside a task.
+void threadpool_sync (void);
+
 // A handler is provided for convenience. It calls 'free' on 'job', whatever the value of 'result', and returns 'result'.
 tp_result_t threadpool_job_free_handler (void *job, tp_result_t result);
 
@@ -61,11 +104,72 @@ tp_result_t threadpool_job_free_handler (void *job, tp_result_t result);
 // 'job_delete' can be used if the 'job' passed to 'threadpool_add_job' has been allocated dynamically and needs to be free'd after use.
 
 // Cancel a pending task identified by its unique id, as returned by threadpool_add_task, or all tasks if task_id is equal to ALL_PENDING_TASKS, or the next submitted task if task_id is equal to NEXT_PENDING_TASK, or the last if equal to LAST_PENDING_TASK.
-// Returns the number of cancelled tasks.
+// A running task identified by its unique id is asked to stop (see threadpool_task_cancel_requested).
+// Returns the number of cancelled tasks (or of running tasks asked to stop).
 extern const tp_task_t TP_CANCEL_ALL_PENDING_TASKS;     // Cancels all pending tasks
 extern const tp_task_t TP_CANCEL_NEXT_PENDING_TASK;     // Cancels next pending task (in submission order)
 extern const tp_task_t TP_CANCEL_LAST_PENDING_TASK;     // Cancels last pending tasks (in submission order)
 size_t threadpool_cancel_task (struct threadpool *threadpool, tp_task_t task_id);
+// Returns non zero if the running task should stop, either because it was asked to by 'threadpool_cancel_task',
+// or because the thread pool has short-circuited (TP_RUN_ONE_SUCCESSFUL_TASK or TP_RUN_ALL_SUCCESSFUL_TASKS). To be polled in 'work'.
+int threadpool_task_cancel_requested (void);
+
+// 'threadpool_task_sleep' suspends the running task for 'seconds', and 'threadpool_task_yield' lets other suspended tasks ready to be resumed run first.
+// With fibers (see threadpool_set_fibers), the thread of the worker processes other tasks meanwhile. Otherwise, or in a task with spawned children not synced yet,
+// or inside a blocking region or a guard (threadpool_guard_begin), the thread sleeps (or yields the processor).
+// With fibers, a sleeping task asked to stop (see threadpool_cancel_task) is woken up at once.
+// With fibers, the task can be resumed by another thread: it should not hold a mutex, nor rely on thread local storage, across these calls.
+void threadpool_task_sleep (double seconds);
+void threadpool_task_yield (void);
+
+// Mark a region of a task which blocks (I/O, sleep, wait for another thread pool...). Regions can be nested.
+// While a worker is in a blocking region, the thread pool can start an extra (compensating) worker beyond the requested number of workers,
+// so that as many workers as requested keep processing tasks. The extra worker retires once the region has ended.
+// No effect if not called by a worker.
+void threadpool_blocking_begin (void);
+void threadpool_blocking_end (void);
+
+// Keep a completion record of every submitted task, so that it can be waited for by 'threadpool_task_wait' (disabled by default).
+// Should be called before any task is submitted, otherwise it has no effect and errno is set to EPERM.
+void threadpool_set_task_futures (struct threadpool *threadpool, int enable);
+
+// Waits for at most 'timeout' seconds (without limit if negative) for the task identified by its unique id to be completed, without destroying the thread pool.
+// Called by a worker of the thread pool, it processes other pending tasks while it waits rather than blocking.
+// Returns non 0 if the task is completed, 0 otherwise (with errno set to ETIMEDOUT, or to EINVAL if the task is unknown or futures are disabled).
+int threadpool_task_wait (struct threadpool *threadpool, tp_task_t task_id, double timeout);
+// Returns the result of a completed task (as returned by 'job_delete' if any, by 'work' otherwise) and reclaims its completion record.
+// Returns TP_JOB_FAILURE, with errno set to EBUSY if the task is not completed yet, or to EINVAL if the task is unknown (or its result has already been retrieved).
+tp_result_t threadpool_task_result (struct threadpool *threadpool, tp_task_t task_id);
+// Completion records are kept until their result is retrieved (or the thread pool is destroyed): every future should be collected, or detached.
+// Releases the completion record of a task whose result won't be retrieved, at once if the task is completed, as soon as it is completed otherwise.
+// Returns 0, with errno set to EINVAL, if the task is unknown (or its result has already been retrieved), non 0 otherwise.
+int threadpool_task_detach (struct threadpool *threadpool, tp_task_t task_id);
+
+// Call to 'threadpool_add_task_after' is MT-safe.
+// Submits a task as 'threadpool_add_task' does, that will be queued only once the 'nb_predecessors' tasks identified by their unique ids in 'predecessors' are completed.
+// A task whose predecessor was canceled is canceled too (as well as a task whose predecessor has failed, for TP_RUN_ALL_SUCCESSFUL_TASKS).
+// Requires futures (see 'threadpool_set_task_futures'). The results of the predecessors should not have been retrieved by 'threadpool_task_result'.
+// Returns 0 on error, a unique id of the submitted task otherwise.
+// Set errno to ENOMEM on error (out of memory), to EINVAL if a predecessor is unknown, to EPERM if futures are disabled.
+tp_task_t threadpool_add_task_after (struct threadpool *threadpool, tp_result_t (*work) (void *job), void *job, tp_result_t (*job_delete) (void *job, tp_result_t result),
+                                     size_t nb_predecessors, const tp_task_t predecessors[]);
+
+// 'threadpool_parallel_for' calls 'body' on chunks [b, e) of at most 'grain' iterations covering the range [begin, end), and returns once all are processed.
+// The range is split in halves, processed in parallel, only when some worker of the threadpool is idle. The caller processes chunks itself meanwhile.
+// It can be called from inside a task. Returns the number of processed iterations (less than end - begin only if tasks of the loop were canceled).
+size_t threadpool_parallel_for (struct threadpool *threadpool, size_t begin, size_t end, size_t grain, void (*body) (size_t begin, size_t end, void *arg), void *arg);
+
+// 'threadpool_wait_all' waits for all the tasks submitted so far (and the tasks they submit) to be finished, without destroying the threadpool.
+// Workers are kept alive (until idle timeout) and the threadpool can be used afterwards. It should not be called by a task of the threadpool (errno is then set to EPERM).
+// Called by a worker of another threadpool (nested threadpools), it processes tasks of the threadpool while it waits rather than blocking,
+// as do 'threadpool_task_wait', 'threadpool_parallel_for' and 'threadpool_wait_and_destroy'.
+void threadpool_wait_all (struct threadpool *threadpool);
+
+// The tasks of 'threadpool' will be processed by the workers of 'lender' (with property TP_RUN_ALL_TASKS) rather than by new threads (0 to cancel the effect).
+// Guest tasks are submitted to 'lender' when tasks are submitted to 'threadpool'. They process tasks of 'threadpool' and return to 'lender' as soon as there is nothing left to process.
+// The number of threads running nested threadpools is therefore bounded by the number of workers of 'lender'. 'lender' should be destroyed after 'threadpool'.
+// Should be called before any task is submitted, otherwise errno is set to EPERM.
+void threadpool_borrow_workers (struct threadpool *threadpool, struct threadpool *lender);
 
 // Once all tasks have been submitted to the threadpool, 'threadpool_wait_and_destroy' waits for all the tasks to be finished and thereafter destroys the threadpool.
 // 'threadpool' should not be used after a call to 'threadpool_wait_and_destroy'.
@@ -84,6 +188,73 @@ void *threadpool_worker_local_data (void);
 // Modify the idle timeout delay (in seconds, default is 0.1 s).
 void threadpool_set_idle_timeout (struct threadpool *threadpool, double delay);
 
+// Modify the spin delay (in seconds, default is 0 s, at most 1 s) during which an idle worker polls for new tasks before it waits (parks) for a signal.
+// Spinning avoids the latency of a wake-up when tasks arrive in bursts, at the cost of CPU time.
+void threadpool_set_idle_spin (struct threadpool *threadpool, double delay);
+
+// Start 'min_workers' warm workers at once (at most the number of workers of the thread pool), which are never ended by the idle timeout.
+// Additional workers are then started asynchronously by a spawner thread, outside of the lock of the thread pool, so that submitters never wait for a thread creation.
+// Should be called after 'threadpool_set_worker_local_data_manager' and 'threadpool_set_global_resource_manager' (workers are started at once).
+// Set errno to EPERM if called after 'threadpool_wait_and_destroy'.
+void threadpool_set_min_workers (struct threadpool *threadpool, size_t min_workers);
+
+// Reap idle workers one at a time: the first one after the idle timeout, the next ones after delays doubling up to 'max_delay' seconds
+// (reset after twice 'max_delay' without retirement), and never reap below 'floor' alive workers (at most the number of workers of the thread pool).
+// Unlike warm workers (threadpool_set_min_workers), the floor workers are not started at once. A 'max_delay' of 0 (the default) lets idle workers retire independently.
+// Sets errno to EINVAL if 'max_delay' is negative.
+void threadpool_set_idle_retirement (struct threadpool *threadpool, size_t floor, double max_delay);
+
+// Let a controller adapt the number of workers at runtime between 'min_workers' and 'max_workers' (at most the number of workers of the thread pool),
+// by hill climbing on the throughput of completed tasks (disabled by default, or if 'max_workers' is 0). Its decisions are passed to the monitor.
+// Sets errno to EINVAL if 'min_workers' is 0 or greater than 'max_workers', to EPERM if called after 'threadpool_wait_and_destroy'.
+void threadpool_set_adaptive_workers (struct threadpool *threadpool, size_t min_workers, size_t max_workers);
+
+// Bound the number of pending tasks to 'max_pending' (0, the default, for no bound), and apply 'policy' to a submission beyond that bound.
+// A worker which submits tasks with TP_BACKPRESSURE_BLOCK processes pending tasks instead of waiting, and submits anyway if there is none it could process.
+// Continuations and spawned tasks (threadpool_spawn) are never throttled. Tasks with predecessors are never run inline.
+// A batch (threadpool_add_tasks) larger than 'max_pending' is admitted by chunks with TP_BACKPRESSURE_BLOCK, and fails with EINVAL with TP_BACKPRESSURE_FAIL.
+// With TP_BACKPRESSURE_RUN_INLINE, the tasks of a batch (threadpool_add_tasks) which fit under the bound are queued, and only the ones beyond it are run inline.
+// Sets errno to EINVAL if 'policy' is unknown.
+void threadpool_set_max_pending (struct threadpool *threadpool, size_t max_pending, tp_backpressure_t policy);
+
+// Enable (or disable) work-stealing scheduling (disabled by default).
+// Tasks submitted by a worker (from inside a task) are then pushed to its own local deque and processed in LIFO order,
+// while idle workers steal the least recently pushed tasks from the local deques of the others.
+// Tasks submitted from outside the thread pool are still queued in the FIFO.
+// It suits recursive (divide and conquer) workloads, but tasks are no longer processed in submission order.
+void threadpool_set_work_stealing (struct threadpool *threadpool, int enable);
+
+// Use a lock-free bounded ring of 'capacity' elements (rounded up to a power of 2) to submit tasks from outside the thread pool (disabled by default).
+// Submitters then only lock the thread pool to wake up an idle worker (or to start a new one), or when the ring is full.
+// Should be called before any task is submitted, otherwise it has no effect and errno is set to EPERM.
+void threadpool_set_lock_free_submission (struct threadpool *threadpool, size_t capacity);
+
+// Anti-starvation of tasks of low priority: a task waiting for longer than 'delay' (in seconds) is moved up to the next priority level (disabled by default, or if 'delay' is 0).
+void threadpool_set_priority_aging (struct threadpool *threadpool, double delay);
+
+#  ifdef __GLIBC__
+// Pin each worker to a CPU (disabled by default):
+typedef int tp_affinity_t;
+extern const tp_affinity_t TP_AFFINITY_NONE;    // Workers are not pinned.
+extern const tp_affinity_t TP_AFFINITY_ROUND_ROBIN;     // Worker i is pinned to the i-th allowed CPU (in the order of CPU ids).
+extern const tp_affinity_t TP_AFFINITY_COMPACT; // Workers fill the CPUs of a NUMA node before the CPUs of the next node.
+extern const tp_affinity_t TP_AFFINITY_SCATTER; // Workers are spread over NUMA nodes, in turn.
+// A worker is pinned before its local data are created, so that they are allocated on its NUMA node, and it steals tasks from workers of the same node first.
+// Should be called before any task is submitted, otherwise it has no effect and errno is set to EPERM.
+void threadpool_set_cpu_affinity (struct threadpool *threadpool, tp_affinity_t affinity);
+
+// Set the stack size and the guard size (in bytes) of the threads of the workers started afterwards.
+// A 'stack_size' of 0 keeps the default stack size (RLIMIT_STACK, usually 8 MB); otherwise it must be at least PTHREAD_STACK_MIN, or errno is set to EINVAL.
+// A 'guard_size' of 0 keeps the default guard size (usually a page), which catches stack overflows.
+// Small stacks let a thread pool run many more workers, for tasks that do not use much of the stack (no large local arrays, no deep recursion).
+void threadpool_set_worker_stack (struct threadpool *threadpool, size_t stack_size, size_t guard_size);
+
+// Run each task on its own fiber (a user-mode context with a stack of 'stack_size' bytes, at least 16 kB), multiplexed over the threads of the workers (disabled by default, or if 'stack_size' is 0).
+// A task which sleeps or yields (threadpool_task_sleep, threadpool_task_yield) is then suspended without holding the thread of a worker, and resumed later by any worker.
+// Sets errno to EINVAL if 'stack_size' is too small.
+void threadpool_set_fibers (struct threadpool *threadpool, size_t stack_size);
+#  endif
+
 // Manage global resources for all tasks.
 // allocator will be called before the first task is processed, deallocator after the last tasks has been processed.
 // Resources will be deallocated and reallocated automatically after idle timeout.
@@ -100,11 +271,28 @@ struct threadpool_monitor
   struct
   {
     size_t nb_requested, nb_max, nb_idle, nb_alive;
+    size_t nb_blocking;         // Number of workers in a blocking region (see threadpool_blocking_begin).
+    size_t nb_compensating;     // Number of alive workers beyond the requested number of workers, compensating the blocking ones.
+    size_t nb_target;           // Number of workers to be kept alive, as decided by the controller (see threadpool_set_adaptive_workers).
+    double throughput;          // Completed tasks per second, as last measured by the controller.
+    size_t nb_created;          // Number of workers started so far (including borrowed threads).
+    size_t nb_reaped;           // Number of workers ended before the thread pool is done (idle or surplus workers).
   } workers;                    // Monitoring workers.
   struct
   {
     size_t nb_submitted, nb_pending, nb_asynchronous, nb_processing, nb_succeeded, nb_failed, nb_canceled;
+    size_t nb_queued[TP_NB_PRIORITY_LEVELS];    // Number of queued tasks per priority level.
+    size_t nb_with_deadline;    // Number of queued tasks with a deadline.
+    size_t nb_expired;          // Number of tasks canceled because their deadline had passed (also counted in nb_canceled).
+    size_t nb_blocked;          // Number of tasks waiting for the completion of their predecessors (also counted in nb_pending).
+    size_t nb_throttled;        // Number of submissions beyond the bound of pending tasks (see threadpool_set_max_pending).
+    double throttled_waiting_time;      // Total time (in seconds) producers have waited with TP_BACKPRESSURE_BLOCK.
   } tasks;                      // Monitoring tasks.
+  struct
+  {
+    size_t nb_slab_bytes;
+    size_t nb_stack_reserved_bytes;     // Stack memory reserved for the alive workers (their stack sizes, of which only the touched pages are committed).
+  } memory;                     // Monitoring memory.
 };
 typedef void (*threadpool_monitor_handler) (struct threadpool_monitor, void *arg);
 // Set monitor handler.